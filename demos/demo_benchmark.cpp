@@ -0,0 +1,24 @@
+// c++ -std=c++14 -I../src -L../src demo_benchmark.cpp -lngs_core
+// ./a.out [json|csv] [seconds per case]    writes taskbenchmark.json or .csv
+
+#include <ngs_core.hpp>
+#include <fstream>
+using namespace ngstd;
+
+
+int main (int argc, char ** argv)
+{
+  string format = argc > 1 ? argv[1] : "json";
+  double maxtime = argc > 2 ? atof(argv[2]) : 0.2;
+
+  int numthreads = EnterTaskManager();
+
+  auto results = RunTaskBenchmarks (maxtime);
+  ofstream out ("taskbenchmark." + format);
+  if (format == "csv")
+    WriteBenchmarkCSV (out, results);
+  else
+    WriteBenchmarkJSON (out, results);
+
+  ExitTaskManager(numthreads);
+}
@@ -0,0 +1,129 @@
+// c++ -std=c++14 -I../src -L../src demo_checks.cpp -lngs_core
+// ./a.out    regression checks of the TaskManager, returns the number of failures
+
+#include <ngs_core.hpp>
+#include <thread>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+using namespace ngstd;
+
+
+static int failures = 0;
+
+static void Check (bool ok, string what)
+{
+  cout << (ok ? "ok       " : "FAILED   ") << what << endl;
+  if (!ok) failures++;
+}
+
+
+// NUMA node of the page at p, -1 if unknown
+static int NodeOfPage (const char * p)
+{
+#if defined(__linux__) && defined(SYS_move_pages)
+  void * page = (void*)(size_t(p) / 4096 * 4096);
+  int status = -1;
+  if (syscall (SYS_move_pages, 0, 1, &page, nullptr, &status, 0) == 0)
+    return status;
+#endif
+  return -1;
+}
+
+// piece t of the memory lands on the node of thread t, also for thread
+// counts which are not multiples of the number of nodes
+static void CheckFirstTouch ()
+{
+  if (task_manager->GetNumNodes() == 1 ||
+      task_manager->GetNumNodes() != Topology::Get().NumNodes() ||
+      NodeOfPage ((const char*)&failures) < 0)
+    {
+      cout << "skipped  first touch, needs every NUMA node and move_pages" << endl;
+      return;
+    }
+
+  int max_threads = TaskManager::GetNumThreads();
+  for (int n = 1; n <= max_threads; n++)
+    {
+      TaskManager::SetNumThreads (n);
+      size_t size = size_t(n) << 22;
+      char * mem = new char[size];
+      ParallelFirstTouch (mem, size);
+
+      // pieces of threads on the same node share the page node
+      Array<int> page_node(n);
+      for (int t = 0; t < n; t++)
+        {
+          IntRange r = Range(size).Split (t, n);
+          page_node[t] = NodeOfPage (mem + (r.First()+r.Next())/2);
+        }
+      bool ok = true;
+      for (int t = 0; t < n; t++)
+        for (int s = 0; s < n; s++)
+          if ( (task_manager->NodeOfThread(t) == task_manager->NodeOfThread(s)) !=
+               (page_node[t] == page_node[s]) )
+            ok = false;
+      Check (ok, "first touch, "+ToString(n)+" threads");
+      delete [] mem;
+    }
+  TaskManager::SetNumThreads (max_threads);
+}
+
+
+// a parallel loop does not wait for workers busy with long tasks of a
+// TaskGroup (or Async), here more tasks than workers
+static void CheckLongTasksAndLoop ()
+{
+  int n = TaskManager::GetNumThreads();
+  atomic<int> done(0);
+  TaskGroup group;
+  for (int i = 0; i < n; i++)
+    group.Run ([&done] ()
+               {
+                 std::this_thread::sleep_for (std::chrono::milliseconds(500));
+                 done++;
+               });
+  std::this_thread::sleep_for (std::chrono::milliseconds(50));
+
+  double start = WallTime();
+  atomic<int> cnt(0);
+  ParallelFor (Range(100000), [&cnt] (size_t i) { cnt++; });
+  double time = WallTime()-start;
+
+  group.Wait();
+  Check (cnt == 100000 && done == n && time < 0.25,
+         "ParallelFor next to "+ToString(n)+" long tasks, "+ToString(time)+" s");
+}
+
+
+// everything which converted to std::function before is accepted as job
+static atomic<int> free_calls(0);
+static void FreeJob (TaskInfo & ti) { free_calls++; }
+
+static void CheckJobFunctions ()
+{
+  int n = TaskManager::GetNumThreads();
+  atomic<int> calls(0);
+  ParallelJob ([pcalls = &calls] (TaskInfo & ti) mutable { (*pcalls)++; });
+  const auto constf = [&calls] (TaskInfo & ti) { calls++; };
+  task_manager->CreateJob (constf, n);
+  task_manager->CreateJob (FreeJob, n);
+  task_manager->CreateJob (&FreeJob, n);
+  Check (calls == 2*n && free_calls == 2*n,
+         "job functions: mutable lambda, const lambda, plain function");
+}
+
+
+int main ()
+{
+  TaskManager::SetFirstTouch (true);
+  int numthreads = EnterTaskManager();
+
+  CheckFirstTouch();
+  CheckLongTasksAndLoop();
+  CheckJobFunctions();
+
+  ExitTaskManager (numthreads);
+  return failures;
+}
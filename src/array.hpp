@@ -542,6 +542,8 @@ namespace ngstd
     {
       allocsize = asize; 
       mem_to_delete = data;
+      if (std::is_trivial<T>::value)
+        FirstTouch (data, sizeof(T)*asize);
     }
 
 
@@ -846,6 +848,8 @@ namespace ngstd
     
     T * hdata = data;
     data = new T[nsize];
+    if (std::is_trivial<T>::value)
+      FirstTouch (data, sizeof(T)*nsize);
 
     if (hdata)
       {
@@ -23,6 +23,9 @@ namespace ngstd
       {
         throw Exception (ToString ("Could not allocate localheap, heapsize = ") + ToString(asize));
       }
+    // Split() gives every thread its own piece
+    if (mult_by_threads)
+      FirstTouch (data, asize);
 
     next = data + totsize;
     p = data;
@@ -40,6 +43,51 @@ namespace ngstd
     return LocalHeap (p + i * size_of_piece, size_of_piece, name);
   }
 
+  void ParallelFirstTouch (void * mem, size_t size)
+  {
+    if (!TaskManager::GetFirstTouch() || !task_manager ||
+        task_manager->GetNumNodes() == 1 || TaskManager::InsideTask())
+      return;
+
+    // piece t, as in LocalHeap::Split, is touched on the node of thread t.
+    // The job splits its tasks evenly over the nodes, so every node gets
+    // as many tasks as the node with the most pieces, and task i of node
+    // j touches the i-th piece of node j. node_local keeps the tasks of a
+    // node on its threads.
+    const size_t pagesize = 4096;
+    char * cmem = static_cast<char*> (mem);
+    int nthreads = TaskManager::GetNumThreads();
+    int nnodes = task_manager->GetNumNodes();
+    auto pieces = [nthreads] (int node)
+      {
+        IntRange threads = task_manager->ThreadsOfNode(node);
+        return Range (min (int(threads.First()), nthreads), min (int(threads.Next()), nthreads));
+      };
+    int per_node = 1;
+    for (int j = 0; j < nnodes; j++)
+      per_node = max (per_node, int(pieces(j).Size()));
+
+    task_manager -> CreateJob
+      ([&] (TaskInfo & ti)
+       {
+         int node = ti.task_nr / per_node;
+         int t = pieces(node).First() + ti.task_nr % per_node;
+         // no piece, or the node lost its workers since the job started
+         if (t >= int(pieces(node).Next()) ||
+             task_manager->NodeOfThread (ti.thread_nr) != node)
+           return;
+
+         // the pages starting in the piece
+         IntRange r = Range(size).Split (t, nthreads);
+         size_t first = size_t(cmem+r.First());
+         first = (first+pagesize-1) / pagesize * pagesize;
+         if (r.First() == 0) first = size_t(cmem);
+         for (size_t p = first; p < size_t(cmem+r.Next()); p += pagesize)
+           *reinterpret_cast<volatile char*> (p) = 0;
+       }, nnodes * per_node, nullptr, false, true);
+  }
+
+
   void LocalHeap :: ThrowException() // throw (LocalHeapOverflow)
   {
     /*
@@ -22,6 +22,23 @@ namespace ngstd
   };
   static Allocator global_alloc;
 
+
+  /**
+     Initializes freshly allocated memory in parallel. Piece t of the
+     memory, as in LocalHeap::Split, is touched first on the NUMA node
+     of thread t, and the OS places its pages there.
+     Active only if enabled by TaskManager::SetFirstTouch, on more than
+     one node and outside of tasks.
+  */
+  NGS_DLL_HEADER void ParallelFirstTouch (void * mem, size_t size);
+
+  /// small blocks are not worth a parallel job
+  INLINE void FirstTouch (void * mem, size_t size)
+  {
+    if (size >= (size_t(1) << 20))
+      ParallelFirstTouch (mem, size);
+  }
+
   /**
      Exception on heap overflow.
      Thrown by allocation on LocalHeap.
@@ -10,11 +10,13 @@
 #include <list>
 #include <tuple>
 #include <mutex>
+#include <condition_variable>
 #include <iomanip>
 #include <cstring>
 #include <climits>
 #include <thread>
 #include <functional>
+#include <typeinfo>
 
 #ifdef __INTEL_COMPILER
 #ifdef WIN32
@@ -120,7 +122,9 @@ namespace ngstd {
 #include "bitarray.hpp"
 
 #include "autodiff.hpp"
+#include "topology.hpp"
 #include "taskmanager.hpp"
+#include "taskbenchmark.hpp"
 
 /// namespace for basic linear algebra
 namespace ngbla
@@ -93,6 +93,8 @@ public:
     for (size_t i = 0; i <= size; i++)
       index[i] = i*entrysize;
     data = new T [size*entrysize]; 
+    if (std::is_trivial<T>::value)
+      FirstTouch (data, sizeof(T)*size*entrysize);
   }
 
   /// Construct table of variable entrysize
@@ -110,6 +112,8 @@ public:
       }
     index[size] = cnt;
     data = new T[cnt];
+    if (std::is_trivial<T>::value)
+      FirstTouch (data, sizeof(T)*cnt);
   }
 
   explicit INLINE Table (const Table<T> & tab2)
@@ -0,0 +1,249 @@
+/**************************************************************************/
+/* File:   taskbenchmark.cpp                                              */
+/* Author: Joachim Schoeberl                                              */
+/* Date:   17. Oct. 2026                                                  */
+/**************************************************************************/
+
+#include "ngs_core.hpp"
+
+namespace ngstd
+{
+
+  // w dependent multiply-adds, not optimized away
+  static INLINE double Work (size_t w, double x)
+  {
+    for (size_t k = 0; k < w; k++)
+      x = x * 1.0000001 + 1e-9;
+    return x;
+  }
+
+  class TaskBenchmark
+  {
+    double maxtime;
+    int nthreads;
+    Array<BenchmarkResult> & results;
+    Array<double> samples;
+
+  public:
+    TaskBenchmark (double amaxtime, int anthreads, Array<BenchmarkResult> & aresults)
+      : maxtime(amaxtime), nthreads(anthreads), results(aresults) { ; }
+
+    // one sample per call of f, normalized to items
+    template <typename TFUNC>
+    void Measure (string name, string param, size_t items, TFUNC f)
+    {
+      Collect (name, param, [&] ()
+               {
+                 double start = WallTime();
+                 f();
+                 return (WallTime()-start) * 1e9 / items;
+               });
+    }
+
+    // sample() returns one sample in nano-seconds
+    template <typename TSAMPLE>
+    void Collect (string name, string param, TSAMPLE sample)
+    {
+      const size_t min_samples = 5, max_samples = 100000;
+      sample();   // warm up
+      samples.SetSize(0);
+      double end = WallTime() + maxtime;
+      do
+        samples.Append (sample());
+      while ((WallTime() < end || samples.Size() < min_samples) &&
+             samples.Size() < max_samples);
+
+      QuickSort (samples);
+      auto percentile = [&] (double p)
+        { return samples[min (size_t(p*samples.Size()), samples.Size()-1)]; };
+
+      BenchmarkResult res;
+      res.name = name;
+      res.param = param;
+      res.nthreads = nthreads;
+      res.samples = samples.Size();
+      double sum = 0;
+      for (double s : samples) sum += s;
+      res.mean = sum / samples.Size();
+      res.min = samples[0];
+      res.p50 = percentile (0.5);
+      res.p90 = percentile (0.9);
+      res.p99 = percentile (0.99);
+      res.max = samples.Last();
+      results.Append (res);
+    }
+
+    void JobLatency ()
+    {
+      Measure ("ParallelJob", "1 task/thread", 1, [] ()
+               { ParallelJob ([] (TaskInfo & ti) { ; }, TasksPerThread(1)); });
+      Measure ("ParallelJob", "100 tasks/thread", 1, [] ()
+               { ParallelJob ([] (TaskInfo & ti) { ; }, TasksPerThread(100)); });
+      // the phases of a job with one task per thread: start is the time
+      // until the last task has started (broadcast through the tree of
+      // start flags), completion the time from the end of the last task
+      // until the master returns (shared counters of the nodes)
+      Array<double> starts(nthreads), ends(nthreads);
+      double call = 0, ret = 0;
+      auto job = [&] ()
+        {
+          call = WallTime();
+          ParallelJob ([&] (TaskInfo & ti)
+                       {
+                         starts[ti.task_nr] = WallTime();
+                         ends[ti.task_nr] = WallTime();
+                       }, nthreads);
+          ret = WallTime();
+        };
+      auto last = [] (FlatArray<double> times)
+        {
+          double t = times[0];
+          for (double ti : times) t = max (t, ti);
+          return t;
+        };
+      Collect ("ParallelJob start", "1 task/thread", [&] ()
+               { job(); return (last(starts)-call) * 1e9; });
+      Collect ("ParallelJob completion", "1 task/thread", [&] ()
+               { job(); return (ret-last(ends)) * 1e9; });
+      Measure ("TaskGroup", "1 task/thread", 1, [this] ()
+               {
+                 TaskGroup group;
+                 for (int i = 0; i < nthreads; i++)
+                   group.Run ([] () { ; });
+                 group.Wait();
+               });
+    }
+
+    void LoopThroughput ()
+    {
+      size_t n = 1 << 20;
+      Array<double> x(n);
+      x = 0.0;
+      auto loop = [&] (string param, Schedule sched)
+        {
+          Measure ("ParallelFor", param, n, [&] ()
+                   {
+                     ParallelFor (Range(n), [&x] (size_t i) { x[i] += 1; }, sched);
+                   });
+        };
+      loop ("static", Schedule::Static());
+      for (size_t grainsize : { 64, 1024, 16384 })
+        loop ("dynamic "+ToString(grainsize), Schedule::Dynamic(grainsize));
+      loop ("guided 64", Schedule::Guided(64));
+      loop ("auto", Schedule::Auto());
+      loop ("affinity", Schedule::Affinity());
+
+      Measure ("ParallelFor", "300 iterations", 1, [&] ()
+               {
+                 ParallelFor (Range(300), [&x] (size_t i) { x[i] += 1; });
+               });
+    }
+
+    void LoopImbalance ()
+    {
+      // same total work, in the imbalanced case the first 10% of the
+      // iterations take 11 times as long as the others
+      int n = 10000;
+      auto loop = [&] (string param, size_t wheavy, size_t wlight)
+        {
+          Measure ("SharedLoop2", param, n, [&] ()
+                   {
+                     SharedLoop2 sl(n);
+                     ParallelJob ([&] (TaskInfo & ti)
+                                  {
+                                    for (auto i : sl)
+                                      if (Work (i < n/10 ? wheavy : wlight, 1.0) < 0)
+                                        throw Exception ("negative work");
+                                  });
+                   });
+        };
+      loop ("balanced", 100, 100);
+      loop ("imbalanced", 550, 50);
+    }
+
+    void Reductions ()
+    {
+      size_t n = 1 << 20;
+      Array<double> x(n);
+      for (size_t i = 0; i < n; i++)
+        x[i] = 1.0 / (i+1);
+
+      double sum = 0;
+      Measure ("ParallelSum", "", n, [&] ()
+               { sum += ParallelSum (Range(n), [&x] (size_t i) { return x[i]; }); });
+      Measure ("ReproducibleSum", "", n, [&] ()
+               { sum += ReproducibleSum (Range(n), [&x] (size_t i) { return x[i]; }); });
+      Measure ("ReproducibleSum", "compensated", n, [&] ()
+               { sum += ReproducibleSum (Range(n), [&x] (size_t i) { return x[i]; }, true); });
+      if (sum < 0)
+        throw Exception ("negative sum");
+    }
+  };
+
+
+  Array<BenchmarkResult> RunTaskBenchmarks (double maxtime, FlatArray<int> thread_counts)
+  {
+    int old_threads = TaskManager::GetNumThreads();
+    int max_threads = task_manager ? old_threads : 1;
+
+    Array<int> counts;
+    for (int nt : thread_counts)
+      counts.Append (min (nt, TaskManager::GetMaxThreads()));
+    if (counts.Size() == 0)
+      {
+        for (int nt = 1; nt < max_threads; nt *= 2)
+          counts.Append (nt);
+        counts.Append (max_threads);
+      }
+
+    Array<BenchmarkResult> results;
+    for (int nt : counts)
+      {
+        if (task_manager)
+          TaskManager::SetNumThreads (nt);
+        TaskBenchmark bench(maxtime, TaskManager::GetNumThreads(), results);
+        bench.JobLatency();
+        bench.LoopThroughput();
+        bench.LoopImbalance();
+        bench.Reductions();
+      }
+    if (task_manager)
+      TaskManager::SetNumThreads (old_threads);
+    return results;
+  }
+
+
+  void WriteBenchmarkJSON (ostream & ost, FlatArray<BenchmarkResult> results)
+  {
+    const Topology & topo = Topology::Get();
+    ost << "{" << endl
+        << "  \"machine\": { \"cpus\": " << topo.NumCpus()
+        << ", \"cores\": " << topo.NumCores()
+        << ", \"sockets\": " << topo.NumSockets()
+        << ", \"nodes\": " << topo.NumNodes()
+        << ", \"threads\": " << TaskManager::GetMaxThreads() << " }," << endl
+        << "  \"unit\": \"ns\"," << endl
+        << "  \"results\": [" << endl;
+    for (size_t i = 0; i < results.Size(); i++)
+      {
+        auto & r = results[i];
+        ost << "    { \"name\": \"" << r.name << "\", \"param\": \"" << r.param
+            << "\", \"threads\": " << r.nthreads << ", \"samples\": " << r.samples
+            << ", \"mean\": " << r.mean << ", \"min\": " << r.min
+            << ", \"p50\": " << r.p50 << ", \"p90\": " << r.p90
+            << ", \"p99\": " << r.p99 << ", \"max\": " << r.max << " }"
+            << (i+1 < results.Size() ? "," : "") << endl;
+      }
+    ost << "  ]" << endl << "}" << endl;
+  }
+
+  void WriteBenchmarkCSV (ostream & ost, FlatArray<BenchmarkResult> results)
+  {
+    ost << "name,param,threads,samples,mean,min,p50,p90,p99,max" << endl;
+    for (auto & r : results)
+      ost << r.name << "," << r.param << "," << r.nthreads << "," << r.samples
+          << "," << r.mean << "," << r.min << "," << r.p50 << "," << r.p90
+          << "," << r.p99 << "," << r.max << endl;
+  }
+
+}
@@ -0,0 +1,57 @@
+#ifndef FILE_TASKBENCHMARK
+#define FILE_TASKBENCHMARK
+
+/**************************************************************************/
+/* File:   taskbenchmark.hpp                                              */
+/* Author: Joachim Schoeberl                                              */
+/* Date:   17. Oct. 2026                                                  */
+/**************************************************************************/
+
+
+namespace ngstd
+{
+
+  /**
+     Timings of one benchmark case: every sample is one call of the
+     measured operation, the statistics are in nano-seconds per item
+     (per job, per loop iteration, ...).
+  */
+  class BenchmarkResult
+  {
+  public:
+    string name;
+    string param;      // grainsize, imbalance, ... empty if none
+    int nthreads;
+    size_t samples;
+    double mean, min, p50, p90, p99, max;
+  };
+
+  /**
+     Micro-benchmarks of the TaskManager, to detect scheduling
+     regressions and to choose thread counts on a machine:
+
+     - job latency (ParallelJob with 1 and 100 tasks per thread,
+       fork/join of one task per thread) for every thread count, and
+       the start and completion phases of a job separately
+     - ParallelFor throughput for several schedules and grain sizes
+     - SharedLoop2 with balanced and imbalanced iterations
+     - ParallelSum and ReproducibleSum
+
+     maxtime is the time per case in seconds, the thread counts default
+     to 1, 2, 4, ... up to the active threads. Must be called from the
+     master thread, the number of threads is restored at the end.
+
+     auto res = RunTaskBenchmarks (0.1);
+     WriteBenchmarkJSON (cout, res);
+  */
+  NGS_DLL_HEADER Array<BenchmarkResult>
+  RunTaskBenchmarks (double maxtime = 0.2, FlatArray<int> thread_counts = FlatArray<int>(0, nullptr));
+
+  /// JSON object with the machine and the results
+  NGS_DLL_HEADER void WriteBenchmarkJSON (ostream & ost, FlatArray<BenchmarkResult> results);
+  /// one line per case, with header
+  NGS_DLL_HEADER void WriteBenchmarkCSV (ostream & ost, FlatArray<BenchmarkResult> results);
+
+}
+
+#endif
@@ -13,23 +13,125 @@
 
 namespace ngstd
 {
+  // cpus of the affinity mask, limited by the cgroup cpu quota
+  static int DefaultNumThreads ()
+  {
+    if (getenv("NGS_NUM_THREADS"))
+      return atoi(getenv("NGS_NUM_THREADS"));
+    int n = Topology::GetThreadBinding().Size();
+    double quota = Topology::CpuQuota();
+    if (quota > 0)
+      n = min (n, max (1, int(ceil(quota))));
+    return n;
+  }
+
   TaskManager * task_manager = nullptr;
   bool TaskManager :: use_paje_trace = false;
-  int TaskManager :: max_threads = getenv("NGS_NUM_THREADS") ? atoi(getenv("NGS_NUM_THREADS")) : std::thread::hardware_concurrency();
-  int TaskManager :: num_threads = 1;
+  int TaskManager :: max_threads = DefaultNumThreads();
+  atomic<int> TaskManager :: num_threads{1};
+  bool TaskManager :: use_elastic = getenv("NGS_ELASTIC_THREADS") && atoi(getenv("NGS_ELASTIC_THREADS"));
+  bool TaskManager :: use_numa = !getenv("NGS_NUMA") || atoi(getenv("NGS_NUMA"));
+  // NGS_PLACEMENT=compact|scatter|cores, NGS_CPU_LIST=0-3,8, or NGS_PIN_THREADS=1
+  static TaskManager::Placement DefaultPlacement ()
+  {
+    if (getenv("NGS_CPU_LIST")) return TaskManager::PLACE_LIST;
+    string policy = getenv("NGS_PLACEMENT") ? getenv("NGS_PLACEMENT") : "";
+    if (policy == "compact") return TaskManager::PLACE_COMPACT;
+    if (policy == "scatter") return TaskManager::PLACE_SCATTER;
+    if (policy == "cores") return TaskManager::PLACE_CORES;
+    if (getenv("NGS_PIN_THREADS") && atoi(getenv("NGS_PIN_THREADS")))
+      return TaskManager::PLACE_COMPACT;
+    return TaskManager::PLACE_NONE;
+  }
+
+  TaskManager::Placement TaskManager :: placement = DefaultPlacement();
+  Array<int> TaskManager :: placement_list =
+    Topology::ParseCpuList (getenv("NGS_CPU_LIST") ? getenv("NGS_CPU_LIST") : "");
+  bool TaskManager :: use_first_touch = getenv("NGS_FIRST_TOUCH") && atoi(getenv("NGS_FIRST_TOUCH"));
+  bool TaskManager :: use_affinity = getenv("NGS_AFFINITY") && atoi(getenv("NGS_AFFINITY"));
+  size_t TaskManager :: min_parallel_costs =
+    getenv("NGS_MIN_PARALLEL_COSTS") ? atol(getenv("NGS_MIN_PARALLEL_COSTS")) : 1000;
+  int TaskManager :: spin_usecs = getenv("NGS_SPIN_USECS") ? atoi(getenv("NGS_SPIN_USECS")) : 100;
   // #ifndef __clang__      
   thread_local int TaskManager :: thread_id;
   // #else
   // __thread int TaskManager :: thread_id;
   // #endif
 
-  const function<void(TaskInfo&)> * TaskManager::func;
+  thread_local TaskQueue * TaskManager :: my_queue = nullptr;
+  thread_local int TaskManager :: task_depth = 0;
+
+  const JobFunction * TaskManager::func;
   const function<void()> * TaskManager::startup_function = nullptr;
   const function<void()> * TaskManager::cleanup_function = nullptr;
 
   
   static mutex copyex_mutex;
 
+  /*
+    Chase-Lev work-stealing deque with fixed capacity.
+    The owner pushes and pops at the bottom, thieves take from the top.
+    If the queue is full, the owner executes the task immediately.
+    Padded by hand, plain new does not honour alignas(64) in C++14.
+  */
+  class TaskQueue
+  {
+    enum { SIZE = 4096 };
+    char pad0[64];
+    atomic<int64_t> top{0};
+    char pad1[64];
+    atomic<int64_t> bottom{0};
+    char pad2[64];
+    atomic<SpawnedTask*> buffer[SIZE];
+    char pad3[64];
+  public:
+    bool Push (SpawnedTask * task)
+    {
+      int64_t b = bottom.load(memory_order_relaxed);
+      int64_t t = top.load(memory_order_acquire);
+      if (b-t >= SIZE) return false;
+      buffer[b % SIZE].store (task, memory_order_relaxed);
+      atomic_thread_fence (memory_order_release);
+      bottom.store (b+1, memory_order_relaxed);
+      return true;
+    }
+
+    SpawnedTask * Pop ()
+    {
+      int64_t b = bottom.load(memory_order_relaxed) - 1;
+      bottom.store (b, memory_order_relaxed);
+      atomic_thread_fence (memory_order_seq_cst);
+      int64_t t = top.load(memory_order_relaxed);
+      if (t > b)
+        {
+          bottom.store (b+1, memory_order_relaxed);
+          return nullptr;
+        }
+      SpawnedTask * task = buffer[b % SIZE].load(memory_order_relaxed);
+      if (t == b)
+        {
+          // last entry, race against thieves
+          if (!top.compare_exchange_strong (t, t+1, memory_order_seq_cst, memory_order_relaxed))
+            task = nullptr;
+          bottom.store (b+1, memory_order_relaxed);
+        }
+      return task;
+    }
+
+    SpawnedTask * Steal ()
+    {
+      int64_t t = top.load(memory_order_acquire);
+      atomic_thread_fence (memory_order_seq_cst);
+      int64_t b = bottom.load(memory_order_acquire);
+      if (t >= b) return nullptr;
+      SpawnedTask * task = buffer[t % SIZE].load(memory_order_relaxed);
+      if (!top.compare_exchange_strong (t, t+1, memory_order_seq_cst, memory_order_relaxed))
+        return nullptr;
+      return task;
+    }
+  };
+
+  
   int EnterTaskManager ()
   {
     if (task_manager)
@@ -40,11 +142,10 @@ namespace ngstd
 
     task_manager = new TaskManager();
 
-    cout << "task-based parallelization (C++11 threads) using "<< task_manager->GetNumThreads() << " threads" << endl;
-
-#ifdef USE_NUMA
-    numa_run_on_node (0);
-#endif
+    cout << "task-based parallelization (C++11 threads) using "<< task_manager->GetNumThreads() << " threads";
+    if (task_manager->GetNumNodes() > 1)
+      cout << " on " << task_manager->GetNumNodes() << " NUMA nodes";
+    cout << endl;
 
 #ifndef WIN32
     // master has maximal priority !
@@ -87,43 +188,92 @@ namespace ngstd
     { 
       if(task_manager && task_manager->active_workers>0)
         {
-          cerr << "Warning: can't change number of threads while TaskManager active!" << endl;
+          // between jobs the master may change the active workers
+          if (!my_queue || thread_id != 0 || task_depth > 0)
+            {
+              cerr << "Warning: number of threads can be changed only by the master thread between jobs!" << endl;
+              return;
+            }
+          if (amax_threads > task_manager->pool_size)
+            cerr << "Warning: TaskManager has only " << task_manager->pool_size << " threads" << endl;
+          task_manager->SetActiveThreads (amax_threads);
           return;
         }
       max_threads = amax_threads;
     }
 
+  void TaskManager :: SetActiveThreads (int n)
+  {
+    n = max (1, min (n, pool_size));
+    int old = num_threads;
+    if (n == old) return;
+
+    // the master keeps workers_on_node up to date, a worker checks
+    // num_threads after it has seen a new jobnr
+    for (int i = n; i < old; i++)
+      workers_on_node[NodeOfThread(i)]--;
+    for (int i = old; i < n; i++)
+      workers_on_node[NodeOfThread(i)]++;
+    num_threads = n;
+    WakeParkedWorkers();
+  }
+
+  void TaskManager :: AdaptNumThreads ()
+  {
+    // check at most once per second, reading /proc and /sys is not free
+    double time = WallTime();
+    if (time < last_adapt + 1) return;
+    last_adapt = time;
+
+    const Topology & topo = Topology::Get();
+    double avail = topo.NumCpus();
+    double quota = Topology::CpuQuota();
+    if (quota > 0) avail = min (avail, quota);
+
+    // our busy workers are part of the load
+    double others = Topology::LoadAverage() - num_threads;
+    if (others > 0) avail = min (avail, topo.NumCpus() - others);
+
+    SetActiveThreads (int(avail+0.5));
+  }
+
 
   TaskManager :: TaskManager()
     {
       num_threads = GetMaxThreads();
-  
-#ifdef USE_NUMA
-      numa_available();
-      num_nodes = numa_max_node() + 1;
-      if (num_nodes > num_threads) num_nodes = num_threads;
+      pool_size = num_threads;
+      last_adapt = 0;
+
+      // NUMA nodes found at runtime, at most 8 and at most one per thread
+      const Topology & topo = Topology::Get();
+      num_nodes = use_numa ? min (min (topo.NumNodes(), 8), pool_size) : 1;
+      if (num_nodes < 1) num_nodes = 1;
+
+      // if there are more hardware nodes, neighbouring ones are merged
+      node_cpus.SetSize (num_nodes);
+      for (auto & c : topo.Cpus())
+        node_cpus[c.node * num_nodes / topo.NumNodes()].Append (c.cpu);
+      for (auto & cpus : node_cpus)
+        QuickSort (cpus);
+      CalcPlacement();
+      CalcStealOrder();
 
       for (int j = 0; j < num_nodes; j++)
         {
-          void * mem = numa_alloc_onnode (sizeof(NodeData), j);
-          nodedata[j] = new (mem) NodeData;
-	  complete[j] = -1;
+          // allocated by the first thread running on the node
+          nodedata[j] = nullptr;
+	  complete[j].val = -1;
           workers_on_node[j] = 0;          
-          // nodedata[j]->participate = -1;
         }
-#else
-      num_nodes = 1;
-      nodedata[0] = new NodeData;
-      complete[0] = -1;
-      workers_on_node[0] = 0;
-      // nodedata[0]->participate = -1;
-#endif
 
       jobnr = 0;
       done = 0;
       sleep = false;
       sleep_usecs = 1000;
       active_workers = 0;
+      parked_workers = 0;
+      num_injected = 0;
+      CalibrateSpin();
 
       static int cnt = 0;
       char buf[100];
@@ -140,51 +290,650 @@ namespace ngstd
   {
     delete trace;
     trace = nullptr;
+    for (int j = 0; j < num_nodes; j++)
+      delete nodedata[j];
+  }
+
+  int TaskManager :: NodeOfThread (int thd) const
+  {
+    return num_nodes * thd / pool_size;
+  }
+
+  IntRange TaskManager :: ThreadsOfNode (int node) const
+  {
+    // inverse of NodeOfThread
+    return IntRange ((node*pool_size+num_nodes-1) / num_nodes,
+                     ((node+1)*pool_size+num_nodes-1) / num_nodes);
+  }
+
+  void TaskManager :: CalcPlacement ()
+  {
+    // the threads of a node are placed on the cpus of the node,
+    // in the order given by the policy
+    const Topology & topo = Topology::Get();
+    Array<int> smt(topo.NumCpus());        // number of the cpu within its core
+    Array<int> on_core(topo.NumCores());
+    on_core = 0;
+    for (size_t i = 0; i < topo.NumCpus(); i++)
+      smt[i] = on_core[topo.Cpu(i).core]++;
+
+    Array<Array<int>> order(num_nodes);
+    for (int node = 0; node < num_nodes; node++)
+      {
+        Array<int> cpus;     // indices into topo.Cpus()
+        for (size_t i = 0; i < topo.NumCpus(); i++)
+          if (topo.Cpu(i).node * num_nodes / topo.NumNodes() == node)
+            cpus.Append (i);
+
+        switch (placement)
+          {
+          case PLACE_SCATTER:
+            // round robin over sockets and L3 domains, SMT siblings last
+            {
+              Array<int> rank(topo.NumCpus());
+              Array<int> in_domain(topo.NumSockets()*topo.NumL3());
+              in_domain = 0;
+              for (int i : cpus)
+                if (smt[i] == 0)
+                  rank[i] = in_domain[topo.Cpu(i).socket*topo.NumL3()+topo.Cpu(i).l3]++;
+              for (int i : cpus)
+                if (smt[i] > 0)
+                  rank[i] = in_domain[topo.Cpu(i).socket*topo.NumL3()+topo.Cpu(i).l3]++;
+              QuickSort (cpus, [&] (int a, int b)
+                         {
+                           return make_tuple (rank[a], topo.Cpu(a).socket, topo.Cpu(a).l3) <
+                             make_tuple (rank[b], topo.Cpu(b).socket, topo.Cpu(b).l3);
+                         });
+              break;
+            }
+          case PLACE_CORES:
+            {
+              // one thread per core, SMT siblings are skipped
+              Array<int> first;
+              for (int i : cpus)
+                if (smt[i] == 0) first.Append (i);
+              cpus = std::move(first);
+              break;
+            }
+          default:
+            // compact: os numbering
+            QuickSort (cpus, [&] (int a, int b) { return topo.Cpu(a).cpu < topo.Cpu(b).cpu; });
+          }
+
+        for (int i : cpus)
+          order[node].Append (topo.Cpu(i).cpu);
+      }
+
+    thread_cpu.SetSize (pool_size);
+    thread_cpu = -1;
+    for (int thd = 0, first = 0; thd < pool_size; thd++)
+      {
+        int node = NodeOfThread (thd);
+        if (thd > 0 && node != NodeOfThread(thd-1)) first = thd;
+        if (placement == PLACE_LIST && placement_list.Size())
+          thread_cpu[thd] = placement_list[thd % placement_list.Size()];
+        else if (placement != PLACE_NONE && placement != PLACE_LIST && order[node].Size())
+          thread_cpu[thd] = order[node][(thd-first) % order[node].Size()];
+      }
+  }
+
+  void TaskManager :: CalcStealOrder ()
+  {
+    // victims sharing the L3 cache (both pinned), then the node, then the others.
+    // Starting after the own thread, the thieves spread over the victims
+    const Topology & topo = Topology::Get();
+    Array<int> l3_of_cpu;
+    for (auto & c : topo.Cpus())
+      {
+        if (c.cpu >= int(l3_of_cpu.Size()))
+          {
+            int old = l3_of_cpu.Size();
+            l3_of_cpu.SetSize (c.cpu+1);
+            for (int i = old; i < c.cpu; i++)
+              l3_of_cpu[i] = -1;
+          }
+        l3_of_cpu[c.cpu] = c.l3;
+      }
+    auto l3 = [&] (int thd)
+      {
+        int cpu = thread_cpu[thd];
+        return (cpu >= 0 && cpu < int(l3_of_cpu.Size())) ? l3_of_cpu[cpu] : -1;
+      };
+    auto distance = [&] (int a, int b)
+      {
+        if (l3(a) >= 0 && l3(a) == l3(b)) return 0;
+        if (NodeOfThread(a) == NodeOfThread(b)) return 1;
+        return 2;
+      };
+
+    steal_order.SetSize (pool_size);
+    for (int thd = 0; thd < pool_size; thd++)
+      {
+        auto & order = steal_order[thd];
+        order.SetSize (0);
+        for (int dist = 0; dist <= 2; dist++)
+          for (int k = 1; k < pool_size; k++)
+            {
+              int victim = (thd+k) % pool_size;
+              if (distance (thd, victim) == dist)
+                order.Append (victim);
+            }
+      }
+  }
+
+  bool TaskManager :: BindWorker (int thd)
+  {
+    if (thread_cpu[thd] >= 0)
+      return Topology::BindThread (thread_cpu.Range (thd, thd+1));
+    // on a single node there is nothing to gain from binding
+    if (num_nodes > 1)
+      return Topology::BindThread (node_cpus[NodeOfThread(thd)]);
+    return false;
+  }
+
+  void TaskManager :: RunNodeTasks (int node, TaskInfo & ti)
+  {
+    NodeData & nd = *(nodedata[node]);
+    IntRange mytasks = Range(int(ntasks)).Split (node, num_nodes);
+
+    int done_tasks = 0;   // added to the shared counter once at the end
+    auto run = [&] (int mytask)
+      {
+        // after a failure or cancellation the remaining tasks are claimed, but skipped
+        if (!cancelled.load(memory_order_relaxed) &&
+            !(token && token->IsCancelled()))
+          {
+            ti.task_nr = mytasks.First()+mytask;
+            ti.ntasks = ntasks;
+
+            RegionTracer t(ti.thread_nr, jobnr, RegionTracer::ID_JOB, ti.task_nr);
+            try
+              {
+                (*func)(ti);
+              }
+            catch (...)
+              {
+                lock_guard<mutex> guard(copyex_mutex);
+                if (!ex)
+                  ex = current_exception();
+                cancelled = true;
+              }
+          }
+        done_tasks++;
+      };
+
+    task_depth = 1;
+    if (affinity)
+      {
+        // block s of the node's tasks belongs to the s-th active thread of
+        // the node, the owner starts with it, then the following blocks
+        IntRange threads = ThreadsOfNode (node);
+        int nslots = NumSlots (node);
+        int own = 0;
+        if (NodeOfThread (ti.thread_nr) == node)
+          own = ti.thread_nr - threads.First();
+
+        for (int k = 0; k < nslots; k++)
+          {
+            int s = (own+k) % nslots;
+            IntRange block = Range(mytasks.Size()).Split (s, nslots);
+            atomic<int> & cnt = nd.slots[s].val;
+            while (cnt.load(memory_order_relaxed) < int(block.Size()))
+              {
+                int i = cnt.fetch_add(1, memory_order_relaxed);
+                if (i >= int(block.Size())) break;
+                run (block.First()+i);
+              }
+          }
+      }
+    else
+      while (1)
+        {
+          if (nd.start_cnt >= mytasks.Size()) break;
+          int mytask = nd.start_cnt.fetch_add(1, memory_order_relaxed);
+          if (mytask >= mytasks.Size()) break;
+          run (mytask);
+        }
+    nd.completed_tasks += done_tasks;
+    task_depth = 0;
+  }
+
+  void TaskManager :: LeaveNode (int node, int ajobnr)
+  {
+    // completion goes through the shared counters of the node, not a tree:
+    // not every worker joins every job. The cost is reported by
+    // RunTaskBenchmarks as "ParallelJob completion", next to "start".
+    NodeData & nd = *(nodedata[node]);
+    nd.participate-=2;
+
+    int oldpart = 1;
+    if (nd.participate.compare_exchange_strong (oldpart, 0))
+      {
+        if (ajobnr < jobnr.load())
+          { // reopen gate
+            nd.participate |= 1;                  
+          }
+        else
+          CompleteNode (node);
+      }
+  }
+
+  void TaskManager :: CompleteNode (int node)
+  {
+    // the gate is closed, all tasks of the node are done
+    NodeData & nd = *(nodedata[node]);
+    if (node != 0)
+      {
+        nd.start_cnt = 0;
+        if (affinity)
+          for (auto & slot : nd.slots)
+            slot.val = 0;
+      }
+    complete[node].val = jobnr.load();
+  }
+
+  int TaskManager :: NumSlots (int node) const
+  {
+    // one slot per active thread of the node
+    IntRange threads = ThreadsOfNode (node);
+    return max (min (int(threads.Next()), num_threads.load()) - int(threads.First()), 1);
+  }
+
+  bool TaskManager :: NodeTasksStarted (int node) const
+  {
+    NodeData & nd = *(nodedata[node]);
+    IntRange mytasks = Range(int(ntasks)).Split (node, num_nodes);
+    if (!affinity)
+      return nd.start_cnt >= int(mytasks.Size());
+
+    int nslots = NumSlots (node);
+    for (int s = 0; s < nslots; s++)
+      if (nd.slots[s].val < int(Range(mytasks.Size()).Split (s, nslots).Size()))
+        return false;
+    return true;
+  }
+
+  void TaskManager :: StealFromNodes (int mynode, TaskInfo & ti)
+  {
+    // own node is done, help with the tasks of the other nodes
+    for (int k = 1; k < num_nodes; k++)
+      {
+        int victim = (mynode+k) % num_nodes;
+        NodeData & vd = *(nodedata[victim]);
+
+        if ( (vd.participate & 1) == 0) continue;
+        if (vd.start_cnt >= Range(int(ntasks)).Split (victim, num_nodes).Size()) continue;
+        if (node_local && (victim == 0 || workers_on_node[victim] > 0)) continue;
+
+        int oldval = vd.participate += 2;
+        if ( (oldval & 1) == 0)
+          { // job not active, going out again
+            vd.participate -= 2;
+            continue;
+          }
+
+        RunNodeTasks (victim, ti);
+        LeaveNode (victim, jobnr);
+      }
+  }
+
+
+  void TaskManager :: CalibrateSpin()
+  {
+    // measure the idle-loop iteration, such that spinning takes spin_usecs
+    const size_t probe = 10000;
+    int dummy = 0;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < probe; i++)
+      {
+        dummy += jobnr.load(memory_order_relaxed);
+        SpinPause();
+      }
+    double usecs = chrono::duration<double,micro> (chrono::steady_clock::now()-start).count();
+    if (usecs < 1e-3) usecs = 1e-3;
+    spin_per_usec = probe / usecs + (dummy & 1);
+    spin_iterations = size_t(spin_usecs * spin_per_usec);
+  }
+
+  void TaskManager :: SetSpinTime (int usecs)
+  {
+    spin_usecs = usecs;
+    // the running workers pick it up at their next idle phase
+    if (task_manager)
+      task_manager->spin_iterations = size_t(usecs * task_manager->spin_per_usec);
+  }
+
+  void TaskManager :: Park (int jobdone)
+  {
+    unique_lock<mutex> guard(park_mutex);
+    parked_workers++;
+    park_cv.wait (guard, [&] { return jobnr != jobdone || done || spawned_tasks > 0; });
+    parked_workers--;
+  }
+
+  void TaskManager :: ParkInactive (int thd)
+  {
+    unique_lock<mutex> guard(park_mutex);
+    parked_workers++;
+    // the first surplus worker also takes tasks of outside threads,
+    // which were pushed before the pool shrank to the master alone
+    park_cv.wait (guard, [&] { return thd < num_threads || done ||
+          (thd == 1 && num_injected > 0); });
+    parked_workers--;
+  }
+
+  void TaskManager :: ForwardJob (int thd)
+  {
+    // binary broadcast tree: every thread wakes two others, instead of all
+    // threads polling the cache line of jobnr written by the master
+    int job = jobnr.load();
+    for (int child = 2*thd+1; child <= 2*thd+2 && child < num_threads; child++)
+      if (start_flags[child].val.load(memory_order_relaxed) < job)
+        start_flags[child].val.store (job, memory_order_release);
+  }
+
+  void TaskManager :: WakeParkedWorkers()
+  {
+    // parked_workers is incremented before the wake-up condition is checked,
+    // so a zero value means nobody can miss the job just published
+    if (parked_workers == 0) return;
+    { lock_guard<mutex> guard(park_mutex); }
+    park_cv.notify_all();
+  }
+
+
+  bool TaskManager :: PushTask (SpawnedTask * task)
+  {
+    if (!my_queue)
+      {
+        // thread outside the pool, the pool threads take it from the fifo.
+        // With only the master active, nobody would take it soon
+        if (active_workers == 0 || num_threads == 1) return false;
+        {
+          lock_guard<mutex> guard(injected_mutex);
+          injected.push_back (task);
+          num_injected++;
+        }
+      }
+    else if (!my_queue->Push (task))
+      return false;
+    spawned_tasks++;
+    WakeParkedWorkers();
+    return true;
+  }
+
+  SpawnedTask * TaskManager :: PopInjected ()
+  {
+    lock_guard<mutex> guard(injected_mutex);
+    if (injected.empty()) return nullptr;
+    SpawnedTask * task = injected.front();
+    injected.pop_front();
+    num_injected--;
+    return task;
+  }
+
+  bool TaskManager :: ProcessTask ()
+  {
+    if (!my_queue) return false;
+    SpawnedTask * task = my_queue->Pop();
+    if (!task)
+      {
+        if (spawned_tasks == 0) return false;
+        // steal, starting with the right neighbour
+        int nq = queues.Size();
+        for (int i = 1; i < nq && !task; i++)
+          task = queues[(thread_id+i) % nq]->Steal();
+        if (!task && num_injected > 0)
+          task = PopInjected();
+        if (!task) return false;
+      }
+    spawned_tasks--;
+    ExecuteTask (task);
+    return true;
+  }
+
+  void TaskManager :: ExecuteTask (SpawnedTask * task)
+  {
+    TaskGroup * group = task->group;
+    task_depth++;
+    try
+      {
+        task->Run();
+      }
+    catch (...)
+      {
+        lock_guard<mutex> guard(group->ex_mutex);
+        if (!group->ex)
+          group->ex = current_exception();
+      }
+    task_depth--;
+    if (task->delete_after_run)
+      delete task;
+    // last access to the group, the waiting thread may delete it now
+    group->pending.fetch_sub (1, memory_order_release);
+  }
+
+  void TaskManager :: CreateNestedJob (JobFunction afunc, int antasks,
+                                       CancellationToken * atoken)
+  {
+    atomic<bool> failed{false};
+    if (antasks > 0)
+      RunNestedTasks (afunc, antasks, 0, antasks, failed, atoken);
+  }
+
+  void TaskManager :: RunNestedTasks (JobFunction afunc, int antasks,
+                                      int first, int next, atomic<bool> & failed,
+                                      CancellationToken * atoken)
+  {
+    // a task of the job has thrown, or the job is cancelled
+    if (failed.load(memory_order_relaxed)) return;
+    if (atoken && atoken->IsCancelled()) return;
+
+    if (next-first == 1)
+      {
+        TaskInfo ti;
+        ti.task_nr = first;
+        ti.ntasks = antasks;
+        ti.thread_nr = thread_id;
+        ti.nthreads = num_threads;
+        ti.nnodes = num_nodes;
+        ti.node_nr = NodeOfThread (thread_id);
+        try
+          {
+            afunc(ti);
+          }
+        catch (...)
+          {
+            failed = true;
+            throw;
+          }
+        return;
+      }
+
+    // spawn the upper half, keep working on the lower half
+    int mid = (first+next)/2;
+    auto upper = [this, afunc, antasks, mid, next, &failed, atoken] ()
+      { RunNestedTasks (afunc, antasks, mid, next, failed, atoken); };
+    LambdaTask<decltype(upper)> task(upper);
+    TaskGroup group;
+    group.Spawn (task);
+    RunNestedTasks (afunc, antasks, first, mid, failed, atoken);
+    group.Wait();
+  }
+
+
+  TaskGroup :: ~TaskGroup ()
+  {
+    while (pending.load(memory_order_acquire) > 0)
+      if (!task_manager || !task_manager->ProcessTask())
+        SpinPause();
+  }
+
+  void TaskGroup :: Spawn (SpawnedTask & task)
+  {
+    task.group = this;
+    pending++;
+    if (!task_manager || !task_manager->PushTask (&task))
+      TaskManager::ExecuteTask (&task);
+  }
+
+  void TaskGroup :: Wait ()
+  {
+    // help with other tasks while waiting, the own ones are popped first
+    while (pending.load(memory_order_acquire) > 0)
+      if (!task_manager || !task_manager->ProcessTask())
+        SpinPause();
+    if (ex)
+      {
+        exception_ptr e = ex;
+        ex = nullptr;
+        rethrow_exception (e);
+      }
+  }
+
+
+  TaskGraph :: ~TaskGraph ()
+  {
+    for (auto n : nodes)
+      delete n;
+  }
+
+  int TaskGraph :: Add (const function<void()> & func, FlatArray<int> deps)
+  {
+    int nr = nodes.Size();
+    for (int d : deps)
+      if (d < 0 || d >= nr)
+        throw Exception ("TaskGraph::Add: dependency on unknown task "+ToString(d));
+
+    Node * node = new Node;
+    node->func = func;
+    node->ndeps = deps.Size();
+    for (int d : deps)
+      nodes[d]->successors.Append (nr);
+    nodes.Append (node);
+    return nr;
+  }
+
+  void TaskGraph :: Start (int nr, TaskGroup & group)
+  {
+    group.Run ([this, nr, &group] ()
+               {
+                 Node & node = *nodes[nr];
+                 node.func();
+                 for (int s : node.successors)
+                   if (--nodes[s]->missing == 0)
+                     Start (s, group);
+               });
+  }
+
+  void TaskGraph :: Run ()
+  {
+    for (auto n : nodes)
+      n->missing = n->ndeps;
+
+    TaskGroup group;
+    for (size_t i = 0; i < nodes.Size(); i++)
+      if (nodes[i]->ndeps == 0)
+        Start (i, group);
+    group.Wait();
   }
 
 
   void TaskManager :: StartWorkers()
   {
     done = false;
-    sync.SetSize(num_threads);
-    sync[0] = new atomic<int>(0);
+    master_binding = Topology::GetThreadBinding();
+    master_bound = BindWorker (0);
+    nodedata[0] = new NodeData (ThreadsOfNode(0).Size());
+    start_flags = Array<PaddedInt> (pool_size);
+    spawned_tasks = 0;
+    queues.SetSize(pool_size);
+    for (auto & q : queues)
+      q = new TaskQueue;
+    my_queue = queues[0];
     completed_tasks = 0;
     nodedata[0]->completed_tasks = 0;
-    for (int i = 1; i < num_threads; i++)
-      {
+
+    // the first worker on a node allocates its NodeData, the pages are
+    // then placed on that node by the first-touch policy
+    int first_workers = 0;
+    for (int i = 1; i < pool_size; i++)
+      if (NodeOfThread(i) != NodeOfThread(i-1))
+        {
+          std::thread([this,i]() { this->Loop(i); }).detach();
+          first_workers++;
+        }
+    while (active_workers < first_workers)
+      ;
+
+    for (int i = 1; i < pool_size; i++)
+      if (NodeOfThread(i) == NodeOfThread(i-1))
         std::thread([this,i]() { this->Loop(i); }).detach();
-      }
 
-    size_t alloc_size = num_threads*NgProfiler::SIZE;
+    size_t alloc_size = pool_size*NgProfiler::SIZE;
     NgProfiler::thread_times = new size_t[alloc_size];
     for (size_t i = 0; i < alloc_size; i++)
       NgProfiler::thread_times[i] = 0;
 
-    while (active_workers < num_threads-1)
+    while (active_workers < pool_size-1)
       ;
   }
   extern size_t dummy_thread_times[NgProfiler::SIZE];
   void TaskManager :: StopWorkers()
   {
     done = true;
+    WakeParkedWorkers();
 
     // collect timings
-    for (size_t i = 0; i < num_threads; i++)
+    for (size_t i = 0; i < pool_size; i++)
       for (size_t j = 0; j < NgProfiler::SIZE; j++)
         NgProfiler::tottimes[j] += 1.0/3.1e9 * NgProfiler::thread_times[i*NgProfiler::SIZE+j];
     delete [] NgProfiler::thread_times;
     NgProfiler::thread_times = dummy_thread_times;
     while (active_workers)
       ;
-    delete sync[0];
+    if (master_bound)
+      Topology::BindThread (master_binding);
+    my_queue = nullptr;
+    for (auto q : queues)
+      delete q;
+    queues.SetSize(0);
     // cout << "workers all stopped !!!!!!!!!!!!!!!!!!!" << endl;
   }
 
 
 
-  void TaskManager :: CreateJob (const function<void(TaskInfo&)> & afunc,
-                                 int antasks)
+  void TaskManager :: CreateExternalJob (JobFunction afunc, int antasks,
+                                         CancellationToken * atoken)
+  {
+    // the job is one fork/join task executed by the pool, the calling
+    // thread waits. Jobs of several threads share the workers.
+    auto root = [this, afunc, antasks, atoken] ()
+      { CreateNestedJob (afunc, antasks, atoken); };
+    LambdaTask<decltype(root)> task(root);
+    TaskGroup group;
+    group.Spawn (task);
+    group.Wait();
+  }
+
+  void TaskManager :: CreateJob (JobFunction afunc,
+                                 int antasks, CancellationToken * atoken,
+                                 bool aaffinity, bool anode_local)
   {
+    if (!my_queue)
+      {
+        // called from a thread not belonging to the pool
+        CreateExternalJob (afunc, antasks, atoken);
+        return;
+      }
+
+    if (task_depth > 0 || thread_id != 0)
+      {
+        // called from inside a task: run as fork/join
+        CreateNestedJob (afunc, antasks, atoken);
+        return;
+      }
+
     trace->StartJob(jobnr, afunc.target_type());
     /*
     for (int j = 0; j < num_nodes; j++)
@@ -196,10 +945,14 @@ namespace ngstd
       }
     */
     func = &afunc;
-    sync[0]->store(1); // , memory_order_release);
 
     ntasks.store (antasks); // , memory_order_relaxed);
+    if (use_elastic) AdaptNumThreads();
     ex = nullptr;
+    cancelled = false;
+    token = atoken;
+    affinity = aaffinity || use_affinity;
+    node_local = anode_local;
 
     // atomic_thread_fence (memory_order_release);
 
@@ -214,6 +967,8 @@ namespace ngstd
     */
 
     nodedata[0]->start_cnt.store (0, memory_order_relaxed);
+    for (auto & slot : nodedata[0]->slots)
+      slot.val.store (0, memory_order_relaxed);
 
     // complete_cnt = 0;
     jobnr++;
@@ -225,6 +980,8 @@ namespace ngstd
         nodedata[j]->participate |= 1;
         // nodedata[j]->participate.store (1, memory_order_release);
       }
+    ForwardJob (0);
+    WakeParkedWorkers();
     if (startup_function) (*startup_function)();
     
     int thd = 0;
@@ -234,66 +991,41 @@ namespace ngstd
     // int tasks_per_node = thds / num_nodes;
     int mynode = num_nodes * thd/thds;
 
-    IntRange mytasks = Range(int(ntasks)).Split (mynode, num_nodes);
-      
-    // #ifdef USE_NUMA
-    // numa_run_on_node (mynode);
-    // #endif
-
-    NodeData & mynode_data = *(nodedata[mynode]);
-
     TaskInfo ti;
     ti.nthreads = thds;
     ti.thread_nr = thd;
     ti.nnodes = num_nodes;
     ti.node_nr = mynode;
 
-    try
-      {
-        while (1)
-          {
-            int mytask = mynode_data.start_cnt++;
-            if (mytask >= mytasks.Size()) break;
-            
-            ti.task_nr = mytasks.First()+mytask;
-            ti.ntasks = ntasks;
-
-              {
-		RegionTracer t(ti.thread_nr, jobnr, RegionTracer::ID_JOB, ti.task_nr);
-                (*func)(ti); 
-                mynode_data.completed_tasks++;
-              }
-
-	      // if (++mynode_data.complete_cnt == mytasks.Size())
-              // complete[mynode] = true;
-          }
-
-      }
-    catch (Exception e)
-      {
-        {
-          // cout << "got exception in TM:" << ex->What() << endl;
-          lock_guard<mutex> guard(copyex_mutex);
-          delete ex;
-          ex = new Exception (e);
-          mynode_data.start_cnt = mytasks.Size();
-          // complete[mynode] = true;
-        }
-      }
+    RunNodeTasks (mynode, ti);
+    StealFromNodes (mynode, ti);
 
     if (cleanup_function) (*cleanup_function)();
     
+    // every gate is closed before the job returns, also of nodes without
+    // active workers: a worker deactivated meanwhile must not join late
     for (int j = 0; j < num_nodes; j++)
-      if (workers_on_node[j])
-        {
-          while (complete[j] != jobnr)
-            ;
-          /*
-          while (completed_tasks+ntasks/num_nodes != nodedata[j]->completed_tasks)
-            cout << "master, check node " << j << " node complete = " << nodedata[j]->completed_tasks << " should be " << completed_tasks+ntasks/num_nodes << endl;
-            ;
-          */
-        }
+      {
+        // help with nested tasks spawned by the workers
+        while (complete[j].val != jobnr)
+          {
+            // the workers of the node may be busy with long tasks (Async, ...)
+            // and not join at all. If the tasks are done and nobody is in
+            // the node, the master closes the gate itself
+            NodeData & nd = *(nodedata[j]);
+            int oldpart = 1;
+            if (nd.participate.load(memory_order_relaxed) == 1 && NodeTasksStarted (j) &&
+                nd.participate.compare_exchange_strong (oldpart, 0))
+              CompleteNode (j);
+            else if (spawned_tasks > 0)
+              ProcessTask();
+          }
+        /*
+        while (completed_tasks+ntasks/num_nodes != nodedata[j]->completed_tasks)
+          cout << "master, check node " << j << " node complete = " << nodedata[j]->completed_tasks << " should be " << completed_tasks+ntasks/num_nodes << endl;
+          ;
+        */
+      }
 
 
     completed_tasks += ntasks / num_nodes;
@@ -304,11 +1036,14 @@ namespace ngstd
 //              << "node tasks = " << nodedata[j]->completed_tasks << endl;
 
     if (ex)
-      throw Exception (*ex);
+      {
+        // the first exception of the job, with its original type
+        exception_ptr e = ex;
+        ex = nullptr;
+        rethrow_exception (e);
+      }
 
     trace->StopJob();
-    for (auto ap : sync)
-      ap->load(); // memory_order_acquire);
   }
     
   void TaskManager :: Loop(int thd)
@@ -321,27 +1056,23 @@ namespace ngstd
     static Timer texit("exit zone");
     static Timer tdec("decrement");
     thread_id = thd;
+    my_queue = queues[thd];
 
-    sync[thread_id] = new atomic<int>(0);
+    int mynode = NodeOfThread (thd);
 
-    int thds = GetNumThreads();
-
-    int mynode = num_nodes * thd/thds;
+    BindWorker (thd);
+    if (thd == 0 || NodeOfThread(thd-1) != mynode)
+      nodedata[mynode] = new NodeData (ThreadsOfNode(mynode).Size());   // first touch on the own node
 
     NodeData & mynode_data = *(nodedata[mynode]);
 
 
 
     TaskInfo ti;
-    ti.nthreads = thds;
     ti.thread_nr = thd;
     ti.nnodes = num_nodes;
     ti.node_nr = mynode;
 
-      
-#ifdef USE_NUMA
-    numa_run_on_node (mynode);
-#endif
     active_workers++;
     workers_on_node[mynode]++;
     int jobdone = 0;
@@ -353,26 +1084,49 @@ namespace ngstd
 #endif
 
     
+    size_t spin = 0;
     while (!done)
       {
-        if (complete[mynode] > jobdone)
-          jobdone = complete[mynode];
+        if (thd >= num_threads)
+          {
+            // surplus worker, parked until SetNumThreads needs it
+            if (thd != 1 || num_injected == 0 || !ProcessTask())
+              ParkInactive (thd);
+            continue;
+          }
+
+        if (complete[mynode].val > jobdone)
+          jobdone = complete[mynode].val;
 
-        if (jobnr == jobdone)
+        // a new job is announced by the parent in the broadcast tree,
+        // the shared jobnr is only checked now and then (and by Park)
+        if (start_flags[thd].val.load(memory_order_acquire) <= jobdone &&
+            (spin % 64 != 0 || jobnr == jobdone))
           {
+            if (spawned_tasks > 0 && ProcessTask())
+              {
+                spin = 0;
+                continue;
+              }
             // RegionTracer t(ti.thread_nr, tCASyield, ti.task_nr);            
-            if(sleep)
-              this_thread::sleep_for(chrono::microseconds(sleep_usecs));
+            if (sleep || spin >= spin_iterations)
+              {
+                Park (jobdone);
+                spin = 0;
+              }
             else
               {
-#ifdef WIN32
-                this_thread::yield();
-#else  // WIN32
-                sched_yield();
-#endif // WIN32
+                spin++;
+                SpinPause();
               }
             continue;
           }
+        spin = 0;
+        ForwardJob (thd);
+
+        // deactivated before this job
+        if (thd >= num_threads) continue;
+        ti.nthreads = num_threads;
         
         /*
         while (mynode_data.participate.load(memory_order_relaxed) == -1)
@@ -422,9 +1176,19 @@ namespace ngstd
         }
         }
 
-        // for (auto ap : sync)
-        // ap->load(); // memory_order_acquire);
-        
+        if (thd >= num_threads)
+          {
+            // deactivated after the check above, the master does not wait
+            // for this worker. Going out again, the gate is closed only if
+            // the tasks are started, else by the thread running them
+            mynode_data.participate -= 2;
+            int oldpart = 1;
+            if (NodeTasksStarted (mynode) &&
+                mynode_data.participate.compare_exchange_strong (oldpart, 0))
+              CompleteNode (mynode);
+            continue;
+          }
+
         for (int j = 0; j < num_nodes; j++)
           while (completed_tasks > nodedata[j]->completed_tasks)
             ;
@@ -436,70 +1200,17 @@ namespace ngstd
         // atomic_thread_fence (memory_order_acquire);
         if (startup_function) (*startup_function)();
         
-        IntRange mytasks = Range(int(ntasks)).Split (mynode, num_nodes);
-          
-        try
-          {
-            
-            while (1)
-              {
-                // int mytask = mynode_data.start_cnt++;
-                if (mynode_data.start_cnt >= mytasks.Size()) break;
-		int mytask = mynode_data.start_cnt.fetch_add(1, memory_order_relaxed);
-                if (mytask >= mytasks.Size()) break;
-                
-                ti.task_nr = mytasks.First()+mytask;
-                ti.ntasks = ntasks;
-                
-                  {
-		    RegionTracer t(ti.thread_nr, jobnr, RegionTracer::ID_JOB, ti.task_nr);
-                    (*func)(ti);
-                    mynode_data.completed_tasks++;
-                  }
-		  // if (++mynode_data.complete_cnt == mytasks.Size())
-                  // complete[mynode] = true;
-              }
-
-          }
-        catch (Exception e)
-          {
-            {
-              // cout << "got exception in TM" << endl; 
-              lock_guard<mutex> guard(copyex_mutex);
-              delete ex;
-              ex = new Exception (e);
-              mynode_data.start_cnt = mytasks.Size();
-              // complete[mynode] = true;
-            }
-          }
+        RunNodeTasks (mynode, ti);
+        StealFromNodes (mynode, ti);
 
 #ifndef __MIC__
         atomic_thread_fence (memory_order_release);     
 #endif // __MIC__
 
         if (cleanup_function) (*cleanup_function)();
-        sync[thread_id]->store(1); // , memory_order_release);
 
         jobdone = jobnr;
-
-        mynode_data.participate-=2;
-
-	{
-	  int oldpart = 1;
-	  if (mynode_data.participate.compare_exchange_strong (oldpart, 0))
-	    {
-              if (jobdone < jobnr.load())
-                { // reopen gate
-                  mynode_data.participate |= 1;                  
-                }
-              else
-                {
-                  if (mynode != 0)
-                    mynode_data.start_cnt = 0;
-                  complete[mynode] = jobnr.load(); 
-                }
-	    }	      
-	}
+        LeaveNode (mynode, jobdone);
       }
     
 
@@ -507,8 +1218,8 @@ namespace ngstd
     mkl_set_num_threads_local(mkl_max);
 #endif
 
-    delete sync[thread_id];
-    workers_on_node[mynode]--;
+    if (thd < num_threads)
+      workers_on_node[mynode]--;
     active_workers--;
   }
 
@@ -26,50 +26,205 @@ namespace ngstd
   };
 
   NGS_DLL_HEADER extern class TaskManager * task_manager;
+
+  /// back off in spin loops, lets other threads on the cpu run
+  INLINE void SpinPause ()
+  {
+#ifdef WIN32
+    this_thread::yield();
+#else  // WIN32
+    sched_yield();
+#endif // WIN32
+  }
+
+  /**
+     Stops a parallel loop early. Tasks not yet started when Cancel()
+     is called are skipped, running tasks may poll IsCancelled().
+  */
+  class CancellationToken
+  {
+    atomic<bool> cancelled{false};
+  public:
+    void Cancel () { cancelled.store (true, memory_order_relaxed); }
+    bool IsCancelled () const { return cancelled.load (memory_order_relaxed); }
+    void Reset () { cancelled.store (false, memory_order_relaxed); }
+  };
+
+  /**
+     Reference to the function of a job, without owning it. Other than
+     std::function it needs no heap allocation, and the call goes through
+     one trampoline per function type, into which the body is inlined.
+     The function must live until the job is finished.
+  */
+  class JobFunction
+  {
+    void * obj;              // the function object
+    void (*fptr) ();         // or a plain function, cast to a common type
+    void (*call) (const JobFunction &, TaskInfo &);
+    const std::type_info * type;
+
+    template <typename T>
+    static void CallObject (const JobFunction & jf, TaskInfo & ti)
+    {
+      (*static_cast<T*> (jf.obj)) (ti);
+    }
+
+    template <typename TFPTR>
+    static void CallPointer (const JobFunction & jf, TaskInfo & ti)
+    {
+      (*reinterpret_cast<TFPTR> (jf.fptr)) (ti);
+    }
+
+  public:
+    /// function objects, called as non-const like by std::function (mutable lambdas)
+    template <typename TFUNC, typename T = typename std::remove_reference<TFUNC>::type,
+              typename std::enable_if<!std::is_function<T>::value &&
+                                      !std::is_same<typename std::decay<TFUNC>::type, JobFunction>::value,
+                                      int>::type = 0>
+    JobFunction (TFUNC && f)
+      : obj(const_cast<void*> (static_cast<const void*> (&f))), fptr(nullptr),
+        call(&CallObject<T>), type(&typeid(T)) { ; }
+
+    /// plain functions
+    template <typename TF,
+              typename std::enable_if<std::is_function<TF>::value, int>::type = 0>
+    JobFunction (TF * f)
+      : obj(nullptr), fptr(reinterpret_cast<void(*)()> (f)),
+        call(&CallPointer<TF*>), type(&typeid(TF*)) { ; }
+
+    void operator() (TaskInfo & ti) const { call (*this, ti); }
+    const std::type_info & target_type () const { return *type; }
+  };
+
+  class TaskGroup;
+  class TaskQueue;
+
+  /// a task for the work-stealing queues, see TaskGroup
+  class SpawnedTask
+  {
+  public:
+    TaskGroup * group = nullptr;
+    bool delete_after_run = false;
+
+    virtual ~SpawnedTask () { ; }
+    virtual void Run () = 0;
+  };
+
+  template <typename TFUNC>
+  class LambdaTask : public SpawnedTask
+  {
+    TFUNC func;
+  public:
+    LambdaTask (TFUNC afunc) : func(afunc) { ; }
+    virtual void Run () override { func(); }
+  };
+
   
   class TaskManager
   {
 //     PajeTrace *trace;
+  public:
+    /**
+       Placement of the threads on the cpus of their NUMA node:
+       NONE .. bound to the node only (on more than one node)
+       COMPACT .. the i-th thread of the node to the i-th cpu, os numbering
+       SCATTER .. round robin over sockets and L3 domains, SMT siblings last
+       CORES .. one thread per physical core, SMT siblings are skipped
+       LIST .. thread i to the i-th cpu of an explicit list (NGS_CPU_LIST)
+    */
+    enum Placement { PLACE_NONE, PLACE_COMPACT, PLACE_SCATTER, PLACE_CORES, PLACE_LIST };
+  private:
+
+    // an atomic int on its own cache line, in arrays with a stride of 64 bytes
+    class PaddedInt
+    {
+    public:
+      atomic<int> val{0};
+      char pad[64-sizeof(atomic<int>)];
+    };
 
+    // the counters are written by different threads, one cache line each
     class NodeData
     {
     public:
       atomic<int> start_cnt{0};
+      char pad1[64-sizeof(atomic<int>)];
       // atomic<int> complete_cnt;
       atomic<int> participate{0};
+      char pad2[64-sizeof(atomic<int>)];
       atomic<int> completed_tasks{0};
       // atomic<int> participate_exit;
+      Array<PaddedInt> slots;   // task counters for affinity scheduling, one per thread
 
+      NodeData (int nthreads) : slots(nthreads) { ; }
       // NodeData() : start_cnt(0), participate(0), participate_exit(0) { ; }
     };
     
-    static const function<void(TaskInfo&)> * func;
+    static const JobFunction * func;
     static const function<void()> * startup_function;
     static const function<void()> * cleanup_function;
     atomic<int> ntasks;
     atomic<int> completed_tasks;
-    Exception * ex;
+    exception_ptr ex;          // first failure of the job
+    atomic<bool> cancelled;    // remaining tasks of the job are skipped
+    CancellationToken * token; // cancellation by the user
+    bool affinity;             // task i runs on the same thread in every job
+    bool node_local;           // no stealing from nodes with active workers
 
     atomic<int> jobnr;
 
-    atomic<int> complete[8];   // max nodes
+    PaddedInt complete[8];     // max nodes
     atomic<int> done;
     atomic<int> active_workers;
     atomic<int> workers_on_node[8];   // max nodes
-    Array<atomic<int>*> sync;
+    // job start, forwarded from thread t to 2t+1 and 2t+2
+    Array<PaddedInt> start_flags;
     int sleep_usecs;
     bool sleep;
 
+    // idle workers spin for spin_iterations, then park on park_cv
+    mutex park_mutex;
+    condition_variable park_cv;
+    atomic<int> parked_workers;
+    atomic<size_t> spin_iterations;
+    double spin_per_usec;      // measured idle-loop iterations per micro-second
+    NGS_DLL_HEADER static int spin_usecs;
+
     NodeData *nodedata[8];
 
     int num_nodes;
-    NGS_DLL_HEADER static int num_threads;
+    Array<Array<int>> node_cpus;   // os cpus of the nodes
+    Array<int> master_binding;     // restored after StopWorkers
+    bool master_bound = false;
+    NGS_DLL_HEADER static bool use_numa;
+    NGS_DLL_HEADER static Placement placement;
+    NGS_DLL_HEADER static Array<int> placement_list;
+    Array<int> thread_cpu;         // os cpu of every thread, -1 .. not pinned
+    Array<Array<int>> steal_order; // other threads, nearest first
+    NGS_DLL_HEADER static bool use_first_touch;
+    NGS_DLL_HEADER static bool use_affinity;
+    NGS_DLL_HEADER static size_t min_parallel_costs;
+    NGS_DLL_HEADER static atomic<int> num_threads;   // active threads
     NGS_DLL_HEADER static int max_threads;
+    int pool_size;             // threads started, workers >= num_threads are parked
+    NGS_DLL_HEADER static bool use_elastic;
+    double last_adapt;
     // #ifndef __clang__    
     static thread_local int thread_id;
     // #else
     // static __thread int thread_id;
     // #endif
+
+    // per-thread Chase-Lev deques for spawned tasks (fork/join)
+    Array<TaskQueue*> queues;
+    atomic<int> spawned_tasks;
+    static thread_local TaskQueue * my_queue;
+    // >0 while the thread executes a task, parallel calls are then nested
+    static thread_local int task_depth;
+    // tasks spawned by threads outside the pool, taken first-in first-out
+    mutex injected_mutex;
+    list<SpawnedTask*> injected;
+    atomic<int> num_injected;
     
     static bool use_paje_trace;
   public:
@@ -81,6 +236,7 @@ namespace ngstd
     void StartWorkers();
     void StopWorkers();
 
+    // idle workers park immediately instead of spinning first
     void SuspendWorkers(int asleep_usecs = 1000 )
       {
         sleep_usecs = asleep_usecs;
@@ -88,26 +244,112 @@ namespace ngstd
       }
     void ResumeWorkers() { sleep = false; }
 
-    static void SetNumThreads(int amax_threads);
+    /// time (in micro-seconds) an idle worker busy-waits before it parks
+    NGS_DLL_HEADER static void SetSpinTime (int usecs);
+    static int GetSpinTime () { return spin_usecs; }
+
+    /// before the start: size of the pool, later: number of active threads
+    NGS_DLL_HEADER static void SetNumThreads(int amax_threads);
+    /// adapt the active threads to cgroup quota and load average before jobs
+    static void SetElastic (bool use) { use_elastic = use; }
     static int GetMaxThreads() { return max_threads; }
     // static int GetNumThreads() { return task_manager ? task_manager->num_threads : 1; }
     static int GetNumThreads() { return num_threads; }
     static int GetThreadId() { return task_manager ? task_manager->thread_id : 0; }
     int GetNumNodes() const { return num_nodes; }
+    /// bind threads to the NUMA nodes, set before the TaskManager is created
+    static void SetNumaBinding (bool use) { use_numa = use; }
+    /// set before the TaskManager is created
+    static void SetPlacement (Placement aplacement, FlatArray<int> cpus = FlatArray<int>(0, nullptr))
+    {
+      placement = aplacement;
+      placement_list = cpus;
+    }
+    static Placement GetPlacementPolicy () { return placement; }
+    /// pin thread i to the i-th allowed cpu (of its node)
+    static void SetThreadPinning (bool use) { SetPlacement (use ? PLACE_COMPACT : PLACE_NONE); }
+    /// os cpu of every thread, -1 for threads not pinned to a single cpu
+    FlatArray<int> GetPlacement () const { return thread_cpu; }
+    /// the other threads, sharing the L3 cache first, then the NUMA node
+    FlatArray<int> GetStealOrder (int thd) const { return steal_order[thd]; }
+    /// large Array, Table and LocalHeap memory is first touched in parallel
+    static void SetFirstTouch (bool use) { use_first_touch = use; }
+    static bool GetFirstTouch () { return use_first_touch; }
+    /// loops with smaller TotalCosts run on the calling thread
+    static void SetMinParallelCosts (size_t costs) { min_parallel_costs = costs; }
+    static size_t GetMinParallelCosts () { return min_parallel_costs; }
+    /// all jobs are scheduled with affinity, see Schedule::Affinity
+    static void SetAffinityScheduling (bool use) { use_affinity = use; }
+    static bool GetAffinityScheduling () { return use_affinity; }
 
     static void SetPajeTrace (bool use)  { use_paje_trace = use; }
     
-    NGS_DLL_HEADER void CreateJob (const function<void(TaskInfo&)> & afunc, 
-                    int antasks = task_manager->GetNumThreads());
+    /**
+       can be called from any thread, also concurrently.
+       With aaffinity, the tasks of a node are split into contiguous
+       blocks, one per thread, and a thread executes its own block
+       before it helps with the others. Jobs with the same number of
+       tasks then run task i on the same thread, and find its data
+       still in the cache.
+       With anode_local, the tasks of a node are executed only by
+       threads of that node (node 0 always has the master).
+    */
+    NGS_DLL_HEADER void CreateJob (JobFunction afunc,
+                    int antasks = task_manager->GetNumThreads(),
+                    CancellationToken * atoken = nullptr,
+                    bool aaffinity = false,
+                    bool anode_local = false);
 
     static void SetStartupFunction (const function<void()> & func) { startup_function = &func; }
     static void SetStartupFunction () { startup_function = nullptr; }
     static void SetCleanupFunction (const function<void()> & func) { cleanup_function = &func; }
     static void SetCleanupFunction () { cleanup_function = nullptr; }    
 
+    /// are we inside a task ? then CreateJob runs nested (fork/join)
+    static bool InsideTask () { return task_depth > 0; }
+
+    /// push to the calling thread's queue, or to the shared fifo for
+    /// threads outside the pool. false if not possible
+    NGS_DLL_HEADER bool PushTask (SpawnedTask * task);
+    /// execute one task from the own or a stolen queue
+    NGS_DLL_HEADER bool ProcessTask ();
+    NGS_DLL_HEADER static void ExecuteTask (SpawnedTask * task);
+
     void Done() { done = true; }
     void Loop(int thread_num);
 
+    /// NUMA node of a thread, and the threads of a node
+    int NodeOfThread (int thd) const;
+    IntRange ThreadsOfNode (int node) const;
+
+  private:
+    void CalcPlacement ();
+    void CalcStealOrder ();
+    bool BindWorker (int thd);
+    void RunNodeTasks (int node, TaskInfo & ti);
+    void StealFromNodes (int mynode, TaskInfo & ti);
+    void LeaveNode (int node, int ajobnr);
+    void CompleteNode (int node);
+    int NumSlots (int node) const;
+    bool NodeTasksStarted (int node) const;
+    void CreateNestedJob (JobFunction afunc, int ntasks,
+                          CancellationToken * atoken);
+    void CreateExternalJob (JobFunction afunc, int ntasks,
+                            CancellationToken * atoken);
+    SpawnedTask * PopInjected ();
+    void RunNestedTasks (JobFunction afunc, int ntasks,
+                         int first, int next, atomic<bool> & failed,
+                         CancellationToken * atoken);
+    void CalibrateSpin();
+    void Park (int jobdone);
+    void ParkInactive (int thd);
+    void SetActiveThreads (int n);
+    void AdaptNumThreads ();
+    void WakeParkedWorkers();
+    void ForwardJob (int thd);
+  public:
+
+    /// a few timings, RunTaskBenchmarks is the complete suite
     static list<tuple<string,double>> Timing ();
   };
 
@@ -118,6 +360,183 @@ namespace ngstd
 
 
 
+
+  /*
+    Fork/join parallelism on top of the work-stealing queues.
+    Tasks are pushed to the queue of the spawning thread, idle
+    threads steal them. Wait() executes tasks until all spawned
+    tasks of this group are done, and rethrows the first exception.
+
+    TaskGroup tg;
+    tg.Run ([&] { Fib(n-1); });
+    Fib(n-2);
+    tg.Wait();
+  */
+  class TaskGroup
+  {
+    atomic<int> pending{0};
+    exception_ptr ex;
+    mutex ex_mutex;
+    friend class TaskManager;
+  public:
+    TaskGroup () = default;
+    TaskGroup (const TaskGroup &) = delete;
+    /// waits for outstanding tasks, exceptions are dropped
+    NGS_DLL_HEADER ~TaskGroup ();
+
+    /// spawn a task owned by the caller, must live until Wait
+    NGS_DLL_HEADER void Spawn (SpawnedTask & task);
+
+    template <typename TFUNC>
+    void Run (TFUNC f)
+    {
+      auto task = new LambdaTask<TFUNC> (f);
+      task->delete_after_run = true;
+      Spawn (*task);
+    }
+
+    NGS_DLL_HEADER void Wait ();
+
+    /// number of spawned tasks not finished yet
+    int NumPending () const { return pending.load(memory_order_acquire); }
+  };
+
+
+  template <typename TFUNC>
+  INLINE void ParallelInvoke (TFUNC f)
+  {
+    f();
+  }
+
+  /// runs all functions in parallel, returns when all are finished
+  template <typename TFUNC, typename ...TFUNCS>
+  INLINE void ParallelInvoke (TFUNC f, TFUNCS ... fs)
+  {
+    LambdaTask<TFUNC> task(f);
+    TaskGroup group;
+    group.Spawn (task);
+    ParallelInvoke (fs...);
+    group.Wait();
+  }
+
+
+
+  /*
+    Handle of a function running asynchronously on the worker pool,
+    created by Async. Get() waits for the result and rethrows an
+    exception of the task. As for std::async, the destructor waits.
+
+    auto fut = Async ([&] { return Assemble(); });
+    Factor (mat);
+    auto vec = fut.Get();
+  */
+  template <typename T>
+  class TaskFuture
+  {
+    class State
+    {
+    public:
+      unique_ptr<T> value;
+      TaskGroup group;   // destroyed first, waits for the task
+    };
+    unique_ptr<State> state;
+
+  public:
+    template <typename TFUNC>
+    explicit TaskFuture (TFUNC f) : state(new State)
+    {
+      State * s = state.get();
+      s->group.Run ([s, f] () { s->value.reset (new T(f())); });
+    }
+    TaskFuture (TaskFuture &&) = default;
+    TaskFuture & operator= (TaskFuture &&) = default;
+
+    bool IsReady () const { return state->group.NumPending() == 0; }
+    /// executes other tasks until this one is done
+    void Wait () { state->group.Wait(); }
+
+    T Get ()
+    {
+      Wait();
+      if (!state->value)
+        throw Exception ("TaskFuture::Get: task has no result");
+      return std::move (*state->value);
+    }
+  };
+
+  template <>
+  class TaskFuture<void>
+  {
+    unique_ptr<TaskGroup> group;
+  public:
+    template <typename TFUNC>
+    explicit TaskFuture (TFUNC f) : group(new TaskGroup)
+    {
+      group->Run (f);
+    }
+    TaskFuture (TaskFuture &&) = default;
+    TaskFuture & operator= (TaskFuture &&) = default;
+
+    bool IsReady () const { return group->NumPending() == 0; }
+    void Wait () { group->Wait(); }
+    void Get () { Wait(); }
+  };
+
+  /// runs f on the worker pool, in the calling thread if it is not a pool thread
+  template <typename TFUNC>
+  INLINE auto Async (TFUNC f) -> TaskFuture<decltype(f())>
+  {
+    return TaskFuture<decltype(f())> (f);
+  }
+
+
+
+  /*
+    Tasks with dependencies, the dependencies must be added before.
+    Run() executes every task as soon as its dependencies are finished,
+    and returns when all tasks are done. Successors of a failed task are
+    not executed, the exception is rethrown by Run().
+
+    TaskGraph graph;
+    int a = graph.Add ([&] { AssembleA(); });
+    int b = graph.Add ([&] { AssembleB(); });
+    graph.Add ([&] { Solve(); }, { a, b });
+    graph.Run();
+  */
+  class TaskGraph
+  {
+    class Node
+    {
+    public:
+      function<void()> func;
+      Array<int> successors;
+      int ndeps = 0;
+      atomic<int> missing{0};
+    };
+    Array<Node*> nodes;
+
+  public:
+    TaskGraph () = default;
+    TaskGraph (const TaskGraph &) = delete;
+    NGS_DLL_HEADER ~TaskGraph ();
+
+    /// returns the number of the new task
+    NGS_DLL_HEADER int Add (const function<void()> & func, FlatArray<int> deps);
+    int Add (const function<void()> & func, initializer_list<int> deps = { })
+    {
+      Array<int> adeps(deps);
+      return Add (func, adeps);
+    }
+
+    size_t Size () const { return nodes.Size(); }
+
+    /// executes the graph, can be called again
+    NGS_DLL_HEADER void Run ();
+
+  private:
+    void Start (int nr, TaskGroup & group);
+  };
+
   
   void RunWithTaskManager (function<void()> alg);
 
@@ -132,20 +551,35 @@ namespace ngstd
   }
   
 
+  /*
+    Estimated work of a loop, in units of about a nano-second (a few
+    floating point operations). Loops cheaper than
+    TaskManager::GetMinParallelCosts() are executed by the caller.
+
+    ParallelFor (n, [&] (size_t i) { x[i] = 0; }, TasksPerThread(1), TotalCosts(n, 1));
+  */
   class TotalCosts
   {
     size_t cost;
   public:
     TotalCosts (size_t _cost) : cost(_cost) { ; }
+    /// n iterations of cost_per_iteration
+    TotalCosts (size_t n, size_t cost_per_iteration) : cost(n*cost_per_iteration) { ; }
     size_t operator ()() { return cost; }
   };
 
+  /// is a parallel job for n iterations of total costs worth its overhead ?
+  INLINE bool UseParallel (size_t n, TotalCosts costs)
+  {
+    return task_manager && n > 1 && costs() >= TaskManager::GetMinParallelCosts();
+  }
+
   template <typename TR, typename TFUNC>
   INLINE void ParallelFor (T_Range<TR> r, TFUNC f, 
                            int antasks = task_manager ? task_manager->GetNumThreads() : 0,
                            TotalCosts costs = 1000)
   {
-    if (task_manager && costs() >= 1000)
+    if (UseParallel (r.Size(), costs))
 
       task_manager -> CreateJob 
         ([r, f] (TaskInfo & ti) 
@@ -153,7 +587,7 @@ namespace ngstd
            auto myrange = r.Split (ti.task_nr, ti.ntasks);
            for (auto i : myrange) f(i);
          }, 
-         antasks);
+         min (size_t(antasks), size_t(r.Size())));
 
     else
 
@@ -179,7 +613,7 @@ namespace ngstd
                                 int antasks = task_manager ? task_manager->GetNumThreads() : 0,
                                 TotalCosts costs = 1000)
   {
-    if (task_manager && costs() >= 1000)
+    if (UseParallel (r.Size(), costs))
 
       task_manager -> CreateJob 
         ([r, f] (TaskInfo & ti) 
@@ -187,7 +621,7 @@ namespace ngstd
            auto myrange = r.Split (ti.task_nr, ti.ntasks);
            f(myrange);
          }, 
-         antasks);
+         min (size_t(antasks), size_t(r.Size())));
 
     else
 
@@ -207,7 +641,219 @@ namespace ngstd
   {
     ParallelForRange (IntRange(n), args...);
   }
-  
+
+
+
+  /*
+    Scheduling policy for ParallelFor / ParallelForRange:
+
+    STATIC .. equal chunks of grainsize, or one chunk per thread
+    DYNAMIC .. threads claim chunks of grainsize from a shared counter
+    GUIDED .. chunks shrink with the remaining work, at least grainsize
+    AUTO .. guided, the grainsize is chosen from the TotalCosts hint and
+            the time measured for the previous calls of the loop
+    AFFINITY .. static, chunk i runs on the same thread as in the previous
+                call with the same number of chunks (cache reuse for
+                repeated sweeps), late threads' chunks are stolen
+
+    ParallelFor (n, [&] (size_t i) { ... }, Schedule::Dynamic(64));
+  */
+  class Schedule
+  {
+  public:
+    enum Type { STATIC, DYNAMIC, GUIDED, AUTO, AFFINITY };
+    Type type;
+    size_t grainsize;   // 0 .. chosen automatically
+
+    explicit Schedule (Type atype, size_t agrainsize = 0)
+      : type(atype), grainsize(agrainsize) { ; }
+
+    static Schedule Static (size_t grainsize = 0) { return Schedule(STATIC, grainsize); }
+    static Schedule Dynamic (size_t grainsize = 0) { return Schedule(DYNAMIC, grainsize); }
+    static Schedule Guided (size_t grainsize = 0) { return Schedule(GUIDED, grainsize); }
+    static Schedule Auto () { return Schedule(AUTO); }
+    /// static chunks, chunk i runs on the same thread in every call
+    static Schedule Affinity (size_t grainsize = 0) { return Schedule(AFFINITY, grainsize); }
+  };
+
+
+  /// hands out chunks of [0,n) to the threads of a dynamic or guided schedule
+  class ChunkDispenser
+  {
+    atomic<size_t> next{0};
+    size_t n;
+    size_t grainsize;
+    size_t nthreads;
+    bool guided;
+  public:
+    ChunkDispenser (size_t an, size_t agrainsize, int anthreads, bool aguided)
+      : n(an), grainsize(max (agrainsize, size_t(1))), nthreads(anthreads), guided(aguided) { ; }
+
+    INLINE bool Get (IntRange & chunk)
+    {
+      size_t first = next.load(memory_order_relaxed);
+      if (first >= n) return false;
+
+      if (!guided)
+        {
+          first = next.fetch_add (grainsize, memory_order_relaxed);
+          if (first >= n) return false;
+          chunk = IntRange (first, min (first+grainsize, n));
+          return true;
+        }
+
+      size_t size;
+      do
+        {
+          if (first >= n) return false;
+          size = min (max ((n-first) / (2*nthreads), grainsize), n-first);
+        }
+      while (!next.compare_exchange_weak (first, first+size, memory_order_relaxed));
+      chunk = IntRange (first, first+size);
+      return true;
+    }
+  };
+
+
+  template <typename TR, typename TFUNC>
+  INLINE void ParallelForRange (T_Range<TR> r, TFUNC f, Schedule sched,
+                                TotalCosts costs = 1000)
+  {
+    if (!UseParallel (r.Size(), costs))
+      {
+        f(r);
+        return;
+      }
+
+    size_t n = r.Size();
+    int nthreads = task_manager->GetNumThreads();
+
+    if (sched.type == Schedule::STATIC)
+      {
+        int ntasks = nthreads;
+        if (sched.grainsize)
+          ntasks = (n+sched.grainsize-1) / sched.grainsize;
+        ParallelForRange (r, f, ntasks, costs);
+        return;
+      }
+
+    if (sched.type == Schedule::AFFINITY)
+      {
+        int ntasks = nthreads;
+        if (sched.grainsize)
+          ntasks = (n+sched.grainsize-1) / sched.grainsize;
+        task_manager -> CreateJob
+          ([r, f] (TaskInfo & ti)
+           {
+             f(r.Split (ti.task_nr, ti.ntasks));
+           },
+           ntasks, nullptr, true);
+        return;
+      }
+
+    // nano-seconds per iteration measured in the previous calls of this loop
+    static atomic<double> ns_per_iteration{0};
+    size_t grainsize = sched.grainsize;
+    if (sched.type == Schedule::AUTO)
+      {
+        // aim for chunks of about 20 micro-seconds
+        double nspi = ns_per_iteration.load(memory_order_relaxed);
+        if (nspi > 0)
+          grainsize = size_t(2e4 / nspi);
+        else if (costs() > 1000)
+          grainsize = size_t(2e4 * n / costs());
+        grainsize = min (grainsize, n / (2*nthreads));
+      }
+
+    ChunkDispenser chunks(n, grainsize, nthreads, sched.type != Schedule::DYNAMIC);
+    double starttime = WallTime();
+    task_manager -> CreateJob
+      ([r, f, &chunks] (TaskInfo & ti)
+       {
+         IntRange chunk;
+         while (chunks.Get (chunk))
+           f(T_Range<TR> (r.First()+chunk.First(), r.First()+chunk.Next()));
+       },
+       nthreads);
+
+    if (sched.type == Schedule::AUTO)
+      ns_per_iteration.store ((WallTime()-starttime) * 1e9 * nthreads / n,
+                              memory_order_relaxed);
+  }
+
+  template <typename TR, typename TFUNC>
+  INLINE void ParallelFor (T_Range<TR> r, TFUNC f, Schedule sched,
+                           TotalCosts costs = 1000)
+  {
+    ParallelForRange (r, [f] (T_Range<TR> myrange)
+                      {
+                        for (auto i : myrange) f(i);
+                      }, sched, costs);
+  }
+
+  /*
+    Several small independent loops in one parallel job, with one
+    synchronization instead of one per loop. The iterations of all
+    loops are concatenated and split evenly into the tasks.
+    The batch can be run repeatedly.
+
+    LoopBatch batch;
+    batch.Add (nv, [&] (size_t i) { x[i] = 0; });
+    batch.Add (ne, [&] (size_t i) { y[i] = 1; });
+    batch.Run();
+  */
+  class LoopBatch
+  {
+    Array<function<void(IntRange)>> loops;   // called with loop-local ranges
+    Array<size_t> first;                     // offsets in the concatenated range
+  public:
+    LoopBatch () { first.Append (0); }
+
+    template <typename TR, typename TFUNC>
+    void AddRange (T_Range<TR> r, TFUNC f)
+    {
+      loops.Append ([r, f] (IntRange sub)
+                    {
+                      f(T_Range<TR> (r.First()+sub.First(), r.First()+sub.Next()));
+                    });
+      first.Append (first.Last() + r.Size());
+    }
+
+    template <typename TFUNC>
+    void AddRange (size_t n, TFUNC f) { AddRange (IntRange(n), f); }
+
+    template <typename TR, typename TFUNC>
+    void Add (T_Range<TR> r, TFUNC f)
+    {
+      AddRange (r, [f] (T_Range<TR> myrange)
+                {
+                  for (auto i : myrange) f(i);
+                });
+    }
+
+    template <typename TFUNC>
+    void Add (size_t n, TFUNC f) { Add (IntRange(n), f); }
+
+    /// total number of iterations
+    size_t Size () const { return first.Last(); }
+    void Clear () { loops.SetSize(0); first.SetSize(1); }
+
+    void Run (int antasks = task_manager ? task_manager->GetNumThreads() : 0,
+              TotalCosts costs = 1000)
+    {
+      ParallelForRange (IntRange(Size()), [this] (IntRange myrange)
+                        {
+                          for (size_t l = 0; l < loops.Size(); l++)
+                            {
+                              size_t lo = max (myrange.First(), first[l]);
+                              size_t hi = min (myrange.Next(), first[l+1]);
+                              if (lo < hi)
+                                loops[l] (IntRange (lo-first[l], hi-first[l]));
+                            }
+                        }, antasks, costs);
+    }
+  };
+
   template <typename TFUNC>
   INLINE void ParallelJob (TFUNC f, 
                            int antasks = task_manager ? task_manager->GetNumThreads() : 1)
@@ -229,6 +875,298 @@ namespace ngstd
       }
   }
 
+
+  /// tasks not started before token.Cancel() are skipped
+  template <typename TFUNC>
+  INLINE void ParallelJob (TFUNC f, CancellationToken & token,
+                           int antasks = task_manager ? task_manager->GetNumThreads() : 1)
+  {
+    if (task_manager)
+
+      task_manager -> CreateJob (f, antasks, &token);
+
+    else
+      
+      {
+        TaskInfo ti;
+        ti.ntasks = antasks;
+        ti.thread_nr = 0; ti.nthreads = 1;
+        ti.node_nr = 0; ti.nnodes = 1;
+        for (ti.task_nr = 0; ti.task_nr < antasks && !token.IsCancelled(); ti.task_nr++)
+          f(ti);
+      }
+  }
+
+  template <typename TR, typename TFUNC>
+  INLINE void ParallelForRange (T_Range<TR> r, TFUNC f, CancellationToken & token,
+                                int antasks = task_manager ? task_manager->GetNumThreads() : 1)
+  {
+    ParallelJob ([r, f] (TaskInfo & ti)
+                 {
+                   f(r.Split (ti.task_nr, ti.ntasks));
+                 }, token, antasks);
+  }
+
+  /// the token is also checked before every index
+  template <typename TR, typename TFUNC>
+  INLINE void ParallelFor (T_Range<TR> r, TFUNC f, CancellationToken & token,
+                           int antasks = task_manager ? task_manager->GetNumThreads() : 1)
+  {
+    ParallelForRange (r, [f, &token] (T_Range<TR> myrange)
+                      {
+                        for (auto i : myrange)
+                          {
+                            if (token.IsCancelled()) return;
+                            f(i);
+                          }
+                      }, token, antasks);
+  }
+
+
+  /// is pred(i) true for some i of the range ?  stops at the first hit
+  template <typename TR, typename TPRED>
+  INLINE bool AnyOf (T_Range<TR> r, TPRED pred)
+  {
+    CancellationToken found;
+    ParallelFor (r, [&found, pred] (TR i)
+                 {
+                   if (pred(i)) found.Cancel();
+                 }, found, TasksPerThread(4));
+    return found.IsCancelled();
+  }
+
+  template <typename TPRED>
+  INLINE bool AnyOf (size_t n, TPRED pred)
+  {
+    return AnyOf (IntRange(n), pred);
+  }
+
+  /**
+     Smallest i of the range with pred(i), r.Next() if there is none.
+     Tasks are started in ascending order, indices behind the current
+     best hit are not tested.
+  */
+  template <typename TR, typename TPRED>
+  INLINE TR FindFirst (T_Range<TR> r, TPRED pred)
+  {
+    atomic<TR> first(r.Next());
+    ParallelForRange (r, [&first, pred] (T_Range<TR> myrange)
+                      {
+                        for (auto i : myrange)
+                          {
+                            TR best = first.load(memory_order_relaxed);
+                            if (i >= best) return;
+                            if (pred(i))
+                              {
+                                while (i < best && !first.compare_exchange_weak (best, i))
+                                  ;
+                                return;
+                              }
+                          }
+                      }, TasksPerThread(4));
+    return first;
+  }
+
+  template <typename TPRED>
+  INLINE size_t FindFirst (size_t n, TPRED pred)
+  {
+    return FindFirst (IntRange(n), pred);
+  }
+
+
+
+  /*
+    Reduction over a range, init must be the neutral element of combine:
+
+    double sum = ParallelReduce (n, 0.0,
+                                 [&] (size_t i) { return x[i]*x[i]; },
+                                 [] (double a, double b) { return a+b; });
+
+    Every task accumulates its part of the range locally and stores its
+    partial result once, the partials are combined in the order of the
+    tasks. The result is reproducible for a fixed number of tasks.
+  */
+  template <typename TR, typename T, typename TMAP, typename TCOMBINE>
+  INLINE T ParallelReduce (T_Range<TR> r, T init, TMAP map, TCOMBINE combine,
+                           int antasks = task_manager ? task_manager->GetNumThreads() : 1)
+  {
+    Array<T> partial(antasks);
+    ParallelJob ([&] (TaskInfo & ti)
+                 {
+                   T sum = init;
+                   for (auto i : r.Split (ti.task_nr, ti.ntasks))
+                     sum = combine (sum, map(i));
+                   partial[ti.task_nr] = sum;
+                 }, antasks);
+
+    T sum = init;
+    for (auto & p : partial)
+      sum = combine (sum, p);
+    return sum;
+  }
+
+  template <typename T, typename ...Args>
+  INLINE T ParallelReduce (size_t n, T init, Args...args)
+  {
+    return ParallelReduce (IntRange(n), init, args...);
+  }
+
+  /// sum of map(i) over the range
+  template <typename TR, typename TMAP>
+  INLINE auto ParallelSum (T_Range<TR> r, TMAP map,
+                           int antasks = task_manager ? task_manager->GetNumThreads() : 1)
+    -> typename std::decay<decltype(map(r.First()))>::type
+  {
+    typedef typename std::decay<decltype(map(r.First()))>::type T;
+    return ParallelReduce (r, T(0), map, [] (T a, T b) { return a+b; }, antasks);
+  }
+
+  template <typename TMAP, typename ...Args>
+  INLINE auto ParallelSum (size_t n, TMAP map, Args...args)
+    -> decltype(ParallelSum (IntRange(n), map, args...))
+  {
+    return ParallelSum (IntRange(n), map, args...);
+  }
+
+
+
+  /// Neumaier's compensated summation, needs strict IEEE (no -ffast-math)
+  template <typename T>
+  class CompensatedSum
+  {
+    T sum;
+    T comp;
+  public:
+    CompensatedSum (T init = T(0)) : sum(init), comp(0) { ; }
+
+    INLINE void Add (T x)
+    {
+      using std::abs;
+      T t = sum + x;
+      if (abs(sum) >= abs(x))
+        comp += (sum - t) + x;
+      else
+        comp += (x - t) + sum;
+      sum = t;
+    }
+
+    INLINE T Value () const { return sum + comp; }
+  };
+
+  /// combine the entries as a balanced binary tree
+  template <typename T, typename TCOMBINE>
+  T PairwiseCombine (FlatArray<T> a, TCOMBINE combine)
+  {
+    if (a.Size() == 1) return a[0];
+    size_t mid = a.Size() / 2;
+    return combine (PairwiseCombine (a.Range(0, mid), combine),
+                    PairwiseCombine (a.Range(mid, a.Size()), combine));
+  }
+
+  /*
+    Reduction with a result independent of the number of threads.
+    The range is cut into blocks of fixed size, which are reduced
+    sequentially, and the block results are combined as a fixed tree.
+  */
+  template <typename TR, typename T, typename TMAP, typename TCOMBINE>
+  INLINE T ReproducibleReduce (T_Range<TR> r, T init, TMAP map, TCOMBINE combine,
+                               size_t blocksize = 4096)
+  {
+    size_t nblocks = (r.Size()+blocksize-1) / blocksize;
+    if (nblocks == 0) return init;
+
+    Array<T> partial(nblocks);
+    ParallelForRange (IntRange(nblocks), [&] (IntRange blocks)
+                      {
+                        for (auto b : blocks)
+                          {
+                            T sum = init;
+                            auto first = r.First()+b*blocksize;
+                            auto next = min (first+blocksize, size_t(r.Next()));
+                            for (auto i : T_Range<TR> (first, next))
+                              sum = combine (sum, map(i));
+                            partial[b] = sum;
+                          }
+                      });
+    return combine (init, PairwiseCombine (FlatArray<T>(partial), combine));
+  }
+
+  /// reproducible sum, optionally compensated within and across the blocks
+  template <typename TR, typename TMAP>
+  INLINE auto ReproducibleSum (T_Range<TR> r, TMAP map, bool compensated = false,
+                               size_t blocksize = 4096)
+    -> typename std::decay<decltype(map(r.First()))>::type
+  {
+    typedef typename std::decay<decltype(map(r.First()))>::type T;
+    if (!compensated)
+      return ReproducibleReduce (r, T(0), map, [] (T a, T b) { return a+b; }, blocksize);
+
+    size_t nblocks = (r.Size()+blocksize-1) / blocksize;
+    Array<T> partial(nblocks);
+    ParallelForRange (IntRange(nblocks), [&] (IntRange blocks)
+                      {
+                        for (auto b : blocks)
+                          {
+                            CompensatedSum<T> sum;
+                            auto first = r.First()+b*blocksize;
+                            auto next = min (first+blocksize, size_t(r.Next()));
+                            for (auto i : T_Range<TR> (first, next))
+                              sum.Add (map(i));
+                            partial[b] = sum.Value();
+                          }
+                      });
+    CompensatedSum<T> sum;
+    for (auto p : partial)
+      sum.Add (p);
+    return sum.Value();
+  }
+
+  template <typename TMAP, typename ...Args>
+  INLINE auto ReproducibleSum (size_t n, TMAP map, Args...args)
+    -> decltype(ReproducibleSum (IntRange(n), map, args...))
+  {
+    return ReproducibleSum (IntRange(n), map, args...);
+  }
+
+
+
+  /// QuickSort with the two partitions sorted in parallel
+  template <class T, typename TLESS>
+  void ParallelQuickSort (FlatArray<T> data, TLESS less, size_t grainsize = 1024)
+  {
+    if (data.Size() <= grainsize)
+      {
+        QuickSort (data, less);
+        return;
+      }
+
+    ptrdiff_t i = 0;
+    ptrdiff_t j = data.Size()-1;
+
+    T midval = data[ (i+j)/2 ];
+  
+    do
+      {
+        while (less (data[i], midval)) i++;
+        while (less (midval, data[j])) j--;
+
+        if (i <= j)
+          {
+	    Swap (data[i], data[j]);
+            i++; j--;
+          }
+      }
+    while (i <= j);
+
+    ParallelInvoke ([&] () { ParallelQuickSort (data.Range (0, j+1), less, grainsize); },
+                    [&] () { ParallelQuickSort (data.Range (i, data.Size()), less, grainsize); });
+  }
+
+  template <class T>
+  INLINE void ParallelQuickSort (FlatArray<T> data)
+  {
+    ParallelQuickSort (data, DefaultLessCl<T>());
+  }
   
   
   /*
@@ -331,8 +1269,9 @@ public:
 
   // lock free popfirst
   // faster for large loops, bug slower for small loops (~1000) ????
+  // one cache line, SharedLoop2 allocates them 64-byte aligned
 
-  class alignas(4096) AtomicRange
+  class alignas(64) AtomicRange
 {
   mutex lock;
   atomic<int> begin;
@@ -372,6 +1311,22 @@ public:
     return true;
   }
 
+  // a quarter of the remaining indices, at least one
+  bool PopChunk (IntRange & r)
+  {
+    int oldbegin = begin.load(std::memory_order_relaxed);
+    int newbegin;
+    do
+      {
+        if (oldbegin >= end) return false;
+        newbegin = oldbegin + max ((end-oldbegin)/4, 1);
+      }
+    while (!begin.compare_exchange_weak (oldbegin, newbegin,
+                                         std::memory_order_relaxed, std::memory_order_relaxed));
+    r = IntRange(oldbegin, newbegin);
+    return true;
+  }
+
   bool PopHalf (IntRange & r)
   {
     // int oldbegin = begin;
@@ -400,81 +1355,78 @@ public:
 
 
 
+  /*
+    Loop with dynamic load balancing. Every thread starts with its share
+    of the range, and claims chunks of a quarter of what is left with one
+    atomic operation. Then it steals half of the remaining indices from
+    other threads, sharing the L3 cache or NUMA node first.
+
+    ParallelJob ([&] (TaskInfo & ti)
+                 {
+                   for (int i : sl) ...           // index by index
+                   for (IntRange r : sl.Ranges()) ...   // chunk by chunk
+                 });
+  */
   class SharedLoop2
   {
-    Array<AtomicRange> ranges;
+    char * mem;       // the ranges, aligned to cache lines
+    size_t memsize;
+    FlatArray<AtomicRange> ranges;
     atomic<int> processed;
     int total;
+
+    // memory of the last SharedLoop2 destroyed by the thread, for the next one
+    class RangeMemory
+    {
+    public:
+      unique_ptr<char[]> mem;
+      size_t size = 0;
+    };
+    static RangeMemory & Cache ()
+    {
+      static thread_local RangeMemory cache;
+      return cache;
+    }
     
     class SharedIterator
     {
       FlatArray<AtomicRange> ranges;
       atomic<int> & processed;
       int total;
-      int myval;
+      int myval, mynext;      // current chunk
       int processed_by_me = 0;
       int me;
-      int steal_from;
+      FlatArray<int> victims;
     public:
       SharedIterator (FlatArray<AtomicRange> _ranges, atomic<int> & _processed, int _total, bool begin_it)
-        : ranges(_ranges), processed(_processed), total(_total)
+        : ranges(_ranges), processed(_processed), total(_total), myval(0), mynext(0),
+          victims(0, nullptr)
       {
         me = TaskManager::GetThreadId();
-        steal_from = me;
+        if (task_manager)
+          victims.Assign (task_manager->GetStealOrder(me));
         if (begin_it)
           GetNext();
       }
       
-      SharedIterator & operator++ () { GetNext(); return *this;}
-
-      /*
-      void GetNext()
+      SharedIterator & operator++ ()
       {
-        while (1)
-          {
-            int nr;
-            if (ranges[me].PopFirst(nr))
-              {
-                processed_by_me++;
-                myval = nr;
-                return;
-              }
+        if (++myval == mynext)
+          GetNext();
+        return *this;
+      }
 
-            processed += processed_by_me;
-            processed_by_me = 0;
+      /// skip the rest of the current chunk
+      void NextChunk () { GetNext(); }
 
-            // done with my work, going to steal ...
-            while (1)
-              {
-                if (processed >= total) return;
-                // steal_from = (steal_from + 1) % ranges.Size();
-                steal_from++;
-                if (steal_from == ranges.Size()) steal_from = 0;
-            
-                // steal half of the work reserved for 'from':
-                IntRange steal;
-                if (ranges[steal_from].PopHalf(steal))
-                  {
-                    // ranges[me].Set(steal);
-                    // break;
-                    myval = steal.First();
-                    processed_by_me++;                    
-                    if (myval+1 < steal.Next())
-                      ranges[me].Set (IntRange(myval+1, steal.Next()));
-                    return;
-                  }
-              }
-          }
-      }
-      */
-      
       void GetNext()
       {
-        int nr;
-        if (ranges[me].PopFirst(nr))
+        IntRange chunk;
+        if (ranges[me].PopChunk(chunk))
           {
-            processed_by_me++;
-            myval = nr;
+            processed_by_me += chunk.Size();
+            myval = chunk.First();
+            mynext = chunk.Next();
             return;
           }
         GetNext2();
@@ -486,101 +1438,518 @@ public:
         processed_by_me = 0;
         
         // done with my work, going to steal ...
-        while (1)
+        for (size_t k = 0; ; k++)
           {
             if (processed >= total) return;
-            // steal_from = (steal_from + 1) % ranges.Size();
-            steal_from++;
-            if (steal_from == ranges.Size()) steal_from = 0;
-            
-            // steal half of the work reserved for 'from':
+            // round robin if there is no TaskManager
+            int victim = victims.Size() ? victims[k % victims.Size()]
+              : (me+1+k) % ranges.Size();
+
+            // steal half of the work reserved for the victim,
+            // keep a chunk and offer the rest to others
             IntRange steal;
-            if (ranges[steal_from].PopHalf(steal))
+            if (ranges[victim].PopHalf(steal))
               {
                 myval = steal.First();
-                processed_by_me++;                    
-                if (myval+1 < steal.Next())
-                  ranges[me].Set (IntRange(myval+1, steal.Next()));
+                mynext = myval + max (int(steal.Size())/4, 1);
+                processed_by_me += mynext-myval;
+                if (mynext < int(steal.Next()))
+                  ranges[me].Set (IntRange(mynext, steal.Next()));
                 return;
               }
           }
       }
       
       int operator* () const { return myval; }
+      IntRange Chunk () const { return IntRange(myval, mynext); }
       bool operator!= (const SharedIterator & it2) const { return processed < total; }
     };
-    
+
+    class ChunkIterator
+    {
+      SharedIterator it;
+    public:
+      ChunkIterator (SharedIterator ait) : it(ait) { ; }
+      IntRange operator* () const { return it.Chunk(); }
+      ChunkIterator & operator++ () { it.NextChunk(); return *this; }
+      bool operator!= (const ChunkIterator & it2) const { return it != it2.it; }
+    };
+
+    class ChunkRange
+    {
+      SharedLoop2 & loop;
+    public:
+      ChunkRange (SharedLoop2 & aloop) : loop(aloop) { ; }
+      ChunkIterator begin() { return ChunkIterator (loop.begin()); }
+      ChunkIterator end() { return ChunkIterator (loop.end()); }
+    };
     
   public:
     SharedLoop2 (IntRange r)
-      : ranges(TaskManager::GetMaxThreads()), processed(0)
+      : ranges(0, nullptr), processed(0)
     {
+      size_t n = TaskManager::GetMaxThreads();
+      size_t bytes = (n+1) * sizeof(AtomicRange);
+      RangeMemory & cache = Cache();
+      if (cache.mem && cache.size >= bytes)
+        {
+          memsize = cache.size;
+          mem = cache.mem.release();
+          cache.size = 0;
+        }
+      else
+        {
+          memsize = bytes;
+          mem = new char[bytes];
+        }
+      size_t offset = (64 - reinterpret_cast<uintptr_t>(mem) % 64) % 64;
+      ranges.Assign (FlatArray<AtomicRange> (n, reinterpret_cast<AtomicRange*> (mem+offset)));
+
       total = r.Size();
-      for (size_t i = 0; i < ranges.Size(); i++)
-        ranges[i].SetNoLock (r.Split(i,ranges.Size()));
+      for (size_t i = 0; i < n; i++)
+        {
+          new (&ranges[i]) AtomicRange;
+          ranges[i].SetNoLock (r.Split(i,n));
+        }
+    }
+
+    SharedLoop2 (const SharedLoop2 &) = delete;
+
+    ~SharedLoop2 ()
+    {
+      for (auto & range : ranges)
+        range.~AtomicRange();
+      RangeMemory & cache = Cache();
+      if (cache.size < memsize)
+        {
+          cache.mem.reset (mem);
+          cache.size = memsize;
+        }
+      else
+        delete [] mem;
     }
     
     SharedIterator begin() { return SharedIterator (ranges, processed, total, true); }
     SharedIterator end()   { return SharedIterator (ranges, processed, total, false); }
+    /// iteration over contiguous chunks, for vectorized loop bodies
+    ChunkRange Ranges() { return ChunkRange (*this); }
   };
 
 
 
 
 
+  /*
+    Bounded lock-free multi-producer multi-consumer queue (D. Vyukov).
+    Every cell carries a sequence number telling whether it is ready
+    for the next push or pop of its round, producers and consumers
+    claim positions by CAS on their own counter.
+    T must be default constructible and copyable.
+  */
+  template <typename T>
+  class MPMCQueue
+  {
+    class Cell
+    {
+    public:
+      atomic<size_t> seq;
+      T data;
+    };
+    Array<Cell> cells;
+    size_t mask;
+    char pad0[64];
+    atomic<size_t> push_pos{0};
+    char pad1[64];
+    atomic<size_t> pop_pos{0};
+    char pad2[64];
+
+    static size_t RoundUp (size_t n)
+    {
+      size_t size = 2;
+      while (size < n) size *= 2;
+      return size;
+    }
+
+  public:
+    /// capacity is rounded up to a power of 2
+    MPMCQueue (size_t capacity)
+      : cells(RoundUp(capacity)), mask(cells.Size()-1)
+    {
+      for (size_t i = 0; i < cells.Size(); i++)
+        cells[i].seq.store (i, memory_order_relaxed);
+    }
+    MPMCQueue (const MPMCQueue &) = delete;
+
+    size_t Capacity () const { return cells.Size(); }
+
+    /// false if the queue is full
+    bool TryPush (const T & item)
+    {
+      size_t pos = push_pos.load (memory_order_relaxed);
+      Cell * cell;
+      while (true)
+        {
+          cell = &cells[pos & mask];
+          size_t seq = cell->seq.load (memory_order_acquire);
+          ptrdiff_t diff = ptrdiff_t(seq) - ptrdiff_t(pos);
+          if (diff == 0)
+            {
+              if (push_pos.compare_exchange_weak (pos, pos+1, memory_order_relaxed))
+                break;
+            }
+          else if (diff < 0)
+            return false;
+          else
+            pos = push_pos.load (memory_order_relaxed);
+        }
+      cell->data = item;
+      cell->seq.store (pos+1, memory_order_release);
+      return true;
+    }
+
+    /// false if the queue is empty
+    bool TryPop (T & item)
+    {
+      size_t pos = pop_pos.load (memory_order_relaxed);
+      Cell * cell;
+      while (true)
+        {
+          cell = &cells[pos & mask];
+          size_t seq = cell->seq.load (memory_order_acquire);
+          ptrdiff_t diff = ptrdiff_t(seq) - ptrdiff_t(pos+1);
+          if (diff == 0)
+            {
+              if (pop_pos.compare_exchange_weak (pos, pos+1, memory_order_relaxed))
+                break;
+            }
+          else if (diff < 0)
+            return false;
+          else
+            pos = pop_pos.load (memory_order_relaxed);
+        }
+      item = cell->data;
+      cell->seq.store (pos+mask+1, memory_order_release);
+      return true;
+    }
+  };
+
+
+  /*
+    Work items processed in parallel, where the processing of an item
+    may discover new items, e.g. the frontier of a graph traversal.
+    All threads of one job take the initial items and the pushed ones
+    until no item is left and none is processed any more, there is no
+    synchronization between levels. If the queue is full, Push processes
+    the item immediately by the calling thread.
+
+    ParallelWorkQueue<int> queue;
+    queue.Run (roots, [&] (int v, ParallelWorkQueue<int> & q)
+               {
+                 for (int w : graph[v])
+                   if (!visited[w].exchange(true)) q.Push (w);
+               });
+  */
+  template <typename T>
+  class ParallelWorkQueue
+  {
+    MPMCQueue<T> queue;
+    atomic<size_t> pending{0};   // pushed, and not finished yet
+    atomic<bool> failed{false};
+    const void * func = nullptr;
+    void (*call) (const void *, const T &, ParallelWorkQueue &) = nullptr;
+
+    template <typename TFUNC>
+    static void Call (const void * func, const T & item, ParallelWorkQueue & q)
+    {
+      (*static_cast<const TFUNC*> (func)) (item, q);
+    }
+
+  public:
+    ParallelWorkQueue (size_t capacity = 1 << 16) : queue(capacity) { ; }
+
+    /// called from the function given to Run
+    void Push (const T & item)
+    {
+      pending++;
+      if (queue.TryPush (item)) return;
+      pending--;
+      call (func, item, *this);
+    }
+
+    /// returns when all items are processed, f(item, queue)
+    template <typename TFUNC>
+    void Run (FlatArray<T> initial, TFUNC f)
+    {
+      func = &f;
+      call = &Call<TFUNC>;
+      failed = false;
+      pending = initial.Size();
+      atomic<size_t> next_initial{0};
+
+      try
+        {
+          ParallelJob ([&] (TaskInfo & ti)
+            {
+              T item;
+              while (!failed.load (memory_order_relaxed))
+                {
+                  size_t i = next_initial.load (memory_order_relaxed);
+                  bool found = false;
+                  if (i < initial.Size())
+                    {
+                      i = next_initial.fetch_add (1, memory_order_relaxed);
+                      if (i < initial.Size())
+                        {
+                          item = initial[i];
+                          found = true;
+                        }
+                    }
+                  if (!found)
+                    found = queue.TryPop (item);
+
+                  if (!found)
+                    {
+                      if (pending.load (memory_order_acquire) == 0) break;
+                      SpinPause();
+                      continue;
+                    }
+
+                  try
+                    {
+                      f(item, *this);
+                    }
+                  catch (...)
+                    {
+                      failed = true;
+                      throw;
+                    }
+                  pending.fetch_sub (1, memory_order_release);
+                }
+            });
+        }
+      catch (...)
+        {
+          // the items left after a failure must not show up in the next Run
+          T item;
+          while (queue.TryPop (item)) ;
+          pending = 0;
+          throw;
+        }
+    }
+  };
+
+
+
+
+
+  /*
+    Split of [0,n) into ranges of equal costs, one per thread.
+    The prefix sums of the costs are computed in parallel and kept, for
+    an Update after the costs of some items have changed, and for the
+    next Calc with the same n.
+    The ranges are grouped by NUMA nodes: NodeRange(j) is the union of
+    the ranges executed by the threads of node j.
+  */
   class Partitioning
   {
     Array<size_t> part;
-    size_t total_costs;
+    size_t total_costs = 0;
+    Array<size_t> prefix;   // prefix[i] = costs of items 0..i
+    int nodes = 1;
   public:
     Partitioning () { ; }
 
     template <typename T>
     Partitioning (const Array<T> & apart) { part = apart; }
 
+    /// the costs are not known, items of a range count equally
     template <typename T>
-    Partitioning & operator= (const Array<T> & apart) { part = apart; return *this; }
+    Partitioning & operator= (const Array<T> & apart)
+    {
+      part = apart;
+      prefix.SetSize (0);
+      nodes = 1;
+      return *this;
+    }
 
     size_t GetTotalCosts() const { return total_costs; }
 
     template <typename TFUNC>
     void Calc (size_t n, TFUNC costs, int size = task_manager ? task_manager->GetNumThreads() : 1)
     {
-      Array<size_t> prefix (n);
+      prefix.SetSize (n);   // memory of the previous Calc is reused
+      total_costs = CalcPrefix (costs);
+      SetParts (size);
+    }
 
+    /// the costs of the items in changed are different now, n is the same
+    template <typename TI, typename TFUNC>
+    void Update (FlatArray<TI> changed, TFUNC costs)
+    {
+      if (part.Size() == 0 || prefix.Size() != Range().Size())
+        throw Exception ("Partitioning::Update needs the costs of a Calc");
+      if (changed.Size() == 0) return;
+
+      Array<size_t> items(changed.Size());
+      for (size_t k = 0; k < changed.Size(); k++)
+        items[k] = changed[k];
+      QuickSort (items);
+
+      // accumulated change of the costs up to the k-th changed item, the
+      // prefix sums are unsigned, a decrease wraps around and back again
+      Array<size_t> first, delta;
       size_t sum = 0;
-      for (auto i : ngstd::Range(n))
+      for (size_t k = 0; k < items.Size(); k++)
         {
-          sum += costs(i);
-          prefix[i] = sum;
+          size_t i = items[k];
+          if (k > 0 && i == items[k-1]) continue;
+          if (i >= prefix.Size())
+            throw Exception ("Partitioning::Update, item "+ToString(i)+" out of range");
+          size_t old = prefix[i] - (i > 0 ? prefix[i-1] : 0);
+          sum += size_t(costs(i)) - old;
+          first.Append (i);
+          delta.Append (sum);
         }
-      total_costs = sum;
-      part.SetSize (size+1);
-      part[0] = 0;
 
-      for (int i = 1; i <= size; i++)
-        part[i] = BinSearch (prefix, sum*i/size);      
+      ParallelForRange (ngstd::Range (first[0], prefix.Size()), [&] (IntRange r)
+        {
+          // last changed item before r.First()
+          size_t k = 0;
+          for (size_t step = first.Size(); step > 0; step /= 2)
+            while (k+step < first.Size() && first[k+step] <= r.First())
+              k += step;
+          for (auto i : r)
+            {
+              while (k+1 < first.Size() && first[k+1] <= i) k++;
+              prefix[i] += delta[k];
+            }
+        });
+
+      total_costs += delta.Last();
+      SetParts (Size());
     }
     
     size_t Size() const { return part.Size()-1; }
     IntRange operator[] (size_t i) const { return ngstd::Range(part[i], part[i+1]); }
     IntRange Range() const { return ngstd::Range(part[0], part[Size()]); }
 
+    /**
+       Range of task t out of ntasks, for any number of tasks: every
+       part counts the same, task t covers the parts t*Size()/ntasks up to
+       (t+1)*Size()/ntasks. Fractions of parts are split by costs if they
+       are known, else by the number of items.
+    */
+    IntRange TaskRange (size_t t, size_t ntasks) const
+    {
+      return ngstd::Range (Position (t, ntasks), Position (t+1, ntasks));
+    }
+
+    /// number of NUMA nodes the ranges are grouped into
+    int NumNodes () const { return nodes; }
+    /// ranges of the threads on node j
+    IntRange NodeRange (int j) const
+    {
+      return ngstd::Range (part[j*Size()/nodes], part[(j+1)*Size()/nodes]);
+    }
 
 
 
   private:
+    // first item of task t out of ntasks
+    size_t Position (size_t t, size_t ntasks) const
+    {
+      size_t p = t * Size() / ntasks;
+      size_t rem = t * Size() % ntasks;
+      if (rem == 0) return part[p];
+
+      size_t first = part[p], next = part[p+1];
+      if (first == next) return first;   // empty part
+      if (prefix.Size() != part[Size()])
+        return first + (next-first) * rem / ntasks;
+
+      // first item with prefix above the target costs
+      size_t before = first > 0 ? prefix[first-1] : 0;
+      size_t target = before + (prefix[next-1]-before) * rem / ntasks;
+      while (first < next)
+        {
+          size_t m = (first+next)/2;
+          if (prefix[m] <= target)
+            first = m+1;
+          else
+            next = m;
+        }
+      return first;
+    }
+
+    template <typename TFUNC>
+    size_t CalcPrefix (TFUNC costs)
+    {
+      size_t n = prefix.Size();
+      int nblocks = TaskManager::GetNumThreads();
+      if (!task_manager || nblocks == 1 || n < 10000)
+        {
+          size_t sum = 0;
+          for (auto i : ngstd::Range(n))
+            {
+              sum += costs(i);
+              prefix[i] = sum;
+            }
+          return sum;
+        }
+
+      // scan of the blocks, then the block offsets are added. Both jobs
+      // are scheduled with affinity, block i is in the same cache
+      Array<size_t> offset(nblocks+1);
+      offset[0] = 0;
+      task_manager -> CreateJob
+        ([&] (TaskInfo & ti)
+         {
+           size_t sum = 0;
+           for (auto i : ngstd::Range(n).Split (ti.task_nr, ti.ntasks))
+             {
+               sum += costs(i);
+               prefix[i] = sum;
+             }
+           offset[ti.task_nr+1] = sum;
+         }, nblocks, nullptr, true);
+
+      for (int b = 0; b < nblocks; b++)
+        offset[b+1] += offset[b];
+
+      task_manager -> CreateJob
+        ([&] (TaskInfo & ti)
+         {
+           size_t off = offset[ti.task_nr];
+           if (off == 0) return;
+           for (auto i : ngstd::Range(n).Split (ti.task_nr, ti.ntasks))
+             prefix[i] += off;
+         }, nblocks, nullptr, true);
+      return offset[nblocks];
+    }
+
+    void SetParts (int size)
+    {
+      part.SetSize (size+1);
+      part[0] = 0;
+      for (int i = 1; i <= size; i++)
+        part[i] = BinSearch (prefix, total_costs*i/size);
+
+      nodes = 1;
+      if (task_manager && size % task_manager->GetNumNodes() == 0)
+        nodes = task_manager->GetNumNodes();
+    }
+
     template <typename Tarray>
-    int BinSearch(const Tarray & v, size_t i) {
-      int n = v.Size();
+    size_t BinSearch(const Tarray & v, size_t i) {
+      size_t n = v.Size();
       if (n == 0) return 0;
       
-      int first = 0;
-      int last = n-1;
+      size_t first = 0;
+      size_t last = n-1;
       if(v[0]>i) return 0;
       if(v[n-1] <= i) return n;
       while(last-first>1) {
-        int m = (first+last)/2;
+        size_t m = (first+last)/2;
         if(v[m]<i)
           first = m;
         else
@@ -599,26 +1968,22 @@ public:
   }
   
 
-  // tasks must be a multiple of part.size
+  // any number of tasks is mapped onto the parts, see Partitioning::TaskRange.
+  // the tasks run on the same thread, and on its NUMA node, in every call,
+  // with several tasks per thread idle threads take tasks of others
   template <typename TFUNC>
   INLINE void ParallelFor (const Partitioning & part, TFUNC f, int tasks_per_thread = 1)
   {
     if (task_manager)
       {
         int ntasks = tasks_per_thread * task_manager->GetNumThreads();
-        if (ntasks % part.Size() != 0)
-          throw Exception ("tasks must be a multiple of part.size");
 
         task_manager -> CreateJob 
           ([&] (TaskInfo & ti) 
            {
-             int tasks_per_part = ti.ntasks / part.Size();
-             int mypart = ti.task_nr / tasks_per_part;
-             int num_in_part = ti.task_nr % tasks_per_part;
-             
-             auto myrange = part[mypart].Split (num_in_part, tasks_per_part);
+             auto myrange = part.TaskRange (ti.task_nr, ti.ntasks);
              for (auto i : myrange) f(i);
-           }, ntasks);
+           }, ntasks, nullptr, true);
       }
     else
       {
@@ -635,22 +2000,15 @@ public:
   INLINE void ParallelForRange (const Partitioning & part, TFUNC f,
                                 int tasks_per_thread = 1, TotalCosts costs = 1000)
   {
-    if (task_manager && costs() >= 1000)
+    if (task_manager && costs() >= TaskManager::GetMinParallelCosts())
       {
         int ntasks = tasks_per_thread * task_manager->GetNumThreads();
-        if (ntasks % part.Size() != 0)
-          throw Exception ("tasks must be a multiple of part.size");
 
         task_manager -> CreateJob 
           ([&] (TaskInfo & ti) 
            {
-             int tasks_per_part = ti.ntasks / part.Size();
-             int mypart = ti.task_nr / tasks_per_part;
-             int num_in_part = ti.task_nr % tasks_per_part;
-             
-             auto myrange = part[mypart].Split (num_in_part, tasks_per_part);
-             f(myrange);
-           }, ntasks);
+             f(part.TaskRange (ti.task_nr, ti.ntasks));
+           }, ntasks, nullptr, true);
       }
     else
       {
@@ -661,6 +2019,146 @@ public:
 
 
 
+  /*
+    Partitioning for loops with unknown costs per item, which are
+    executed many times. The time of every part is measured, and the
+    ranges for the next call are chosen such that every part gets the
+    same measured time. The cost density is kept on a grid of bins and
+    averaged over the calls, so the ranges converge instead of
+    oscillating with the noise of the timings.
+
+    MeasuredPartitioning mp(nel);
+    for (int step = 0; step < nsteps; step++)
+      ParallelFor (mp, [&] (size_t i) { ... });
+  */
+  class MeasuredPartitioning
+  {
+    Partitioning part;
+    size_t n = 0;
+    Array<double> density;   // averaged time per item, per bin
+    Array<double> times;     // time of every part in the last call
+    double weight = 0.5;     // of the newest measurement in the average
+
+    size_t BinFirst (size_t b) const { return b*n/density.Size(); }
+
+  public:
+    MeasuredPartitioning (size_t an = 0, int size = task_manager ? task_manager->GetNumThreads() : 1)
+    {
+      Reset (an, size);
+    }
+
+    /// equal ranges, forget the measurements
+    void Reset (size_t an, int size = task_manager ? task_manager->GetNumThreads() : 1)
+    {
+      n = an;
+      Array<size_t> splits(size+1);
+      for (int i = 0; i <= size; i++)
+        splits[i] = i*n/size;
+      part = splits;
+      density.SetSize (min (n, size_t(16*size)));
+      density = -1.0;   // not measured yet
+      times.SetSize (size);
+      times = 0.0;
+    }
+
+    const Partitioning & GetPartitioning () const { return part; }
+    size_t Size () const { return part.Size(); }
+    IntRange operator[] (size_t i) const { return part[i]; }
+
+    /// weight of the newest measurement, 1 .. use only the last call
+    void SetWeight (double aweight) { weight = aweight; }
+
+    /// time of part i in this call, called by the thread executing it
+    void Record (size_t i, double time) { times[i] = time; }
+
+    /// new ranges from the recorded times
+    void Update ()
+    {
+      size_t nbins = density.Size();
+      if (nbins == 0) return;
+
+      // time per item of the parts, averaged into the bins
+      size_t p = 0;
+      for (size_t b = 0; b < nbins; b++)
+        {
+          IntRange bin (BinFirst(b), BinFirst(b+1));
+          double sum = 0;
+          while (p+1 < part.Size() && part[p].Next() <= bin.First()) p++;
+          for (size_t q = p; q < part.Size() && part[q].First() < bin.Next(); q++)
+            {
+              size_t first = max (bin.First(), part[q].First());
+              size_t next = min (bin.Next(), part[q].Next());
+              if (next > first)
+                sum += (next-first) * times[q] / part[q].Size();
+            }
+          double measured = sum / bin.Size();
+          density[b] = density[b] < 0 ? measured : (1-weight)*density[b] + weight*measured;
+        }
+
+      // split the integral of the density into equal pieces
+      double total = 0;
+      for (size_t b = 0; b < nbins; b++)
+        total += density[b] * (BinFirst(b+1)-BinFirst(b));
+      if (total <= 0) return;
+
+      size_t size = part.Size();
+      Array<size_t> splits(size+1);
+      splits[0] = 0;
+      splits[size] = n;
+      size_t b = 0;
+      double before = 0;   // integral up to bin b
+      for (size_t k = 1; k < size; k++)
+        {
+          double target = total * k / size;
+          while (b+1 < nbins &&
+                 before + density[b] * (BinFirst(b+1)-BinFirst(b)) <= target)
+            {
+              before += density[b] * (BinFirst(b+1)-BinFirst(b));
+              b++;
+            }
+          size_t pos = BinFirst(b);
+          if (density[b] > 0)
+            pos += size_t ((target-before) / density[b]);
+          splits[k] = max (splits[k-1], min (pos, n));
+        }
+      part = splits;
+    }
+  };
+
+
+  /// every part is one task, the measured times determine the parts of the next call
+  template <typename TFUNC>
+  INLINE void ParallelForRange (MeasuredPartitioning & mp, TFUNC f)
+  {
+    if (!task_manager || mp.Size() == 1)
+      {
+        for (size_t i = 0; i < mp.Size(); i++)
+          f(mp[i]);
+        return;
+      }
+
+    task_manager -> CreateJob
+      ([&] (TaskInfo & ti)
+       {
+         double start = WallTime();
+         f(mp[ti.task_nr]);
+         mp.Record (ti.task_nr, WallTime()-start);
+       }, mp.Size(), nullptr, true);
+    mp.Update();
+  }
+
+  template <typename TFUNC>
+  INLINE void ParallelFor (MeasuredPartitioning & mp, TFUNC f)
+  {
+    ParallelForRange (mp, [f] (IntRange myrange)
+                      {
+                        for (auto i : myrange) f(i);
+                      });
+  }
+
+
+
+
 
 }
 
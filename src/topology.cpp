@@ -0,0 +1,237 @@
+/**************************************************************************/
+/* File:   topology.cpp                                                   */
+/* Author: Joachim Schoeberl                                              */
+/* Date:   17. Oct. 2026                                                  */
+/**************************************************************************/
+
+#include "ngs_core.hpp"
+#include <fstream>
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace ngstd
+{
+
+  static int ReadIntFile (const string & filename, int def)
+  {
+    ifstream in(filename);
+    int val;
+    if (in >> val) return val;
+    return def;
+  }
+
+  static string ReadLineFile (const string & filename)
+  {
+    ifstream in(filename);
+    string line;
+    getline (in, line);
+    return line;
+  }
+
+  Array<int> Topology :: ParseCpuList (const string & list)
+  {
+    Array<int> cpus;
+    stringstream str(list);
+    string item;
+    while (getline (str, item, ','))
+      {
+        if (item.empty()) continue;
+        auto pos = item.find('-');
+        int first = atoi (item.c_str());
+        int last = (pos == string::npos) ? first : atoi (item.c_str()+pos+1);
+        for (int i = first; i <= last; i++)
+          cpus.Append (i);
+      }
+    return cpus;
+  }
+
+  // replace the keys by consecutive numbers, keeping the order
+  static int Renumber (FlatArray<long> keys, Array<int> & numbers)
+  {
+    Array<long> sorted(keys);
+    QuickSort (sorted);
+    Array<long> unique;
+    for (long k : sorted)
+      if (unique.Size() == 0 || unique.Last() != k)
+        unique.Append (k);
+
+    numbers.SetSize (keys.Size());
+    for (size_t i = 0; i < keys.Size(); i++)
+      numbers[i] = std::lower_bound (&unique[0], &unique[0]+unique.Size(), keys[i]) - &unique[0];
+    return unique.Size();
+  }
+
+
+  Topology :: Topology ()
+  {
+    Array<int> allowed = GetThreadBinding();
+    size_t n = allowed.Size();
+
+    Array<long> node_keys(n), socket_keys(n), core_keys(n), l3_keys(n);
+    node_keys = 0;
+    for (size_t i = 0; i < n; i++)
+      {
+        socket_keys[i] = 0;
+        core_keys[i] = allowed[i];
+        l3_keys[i] = 0;
+      }
+
+#ifdef __linux__
+    const string sysnode = "/sys/devices/system/node/";
+    for (int node : ParseCpuList (ReadLineFile (sysnode+"online")))
+      for (int cpu : ParseCpuList (ReadLineFile (sysnode+"node"+ToString(node)+"/cpulist")))
+        for (size_t i = 0; i < n; i++)
+          if (allowed[i] == cpu)
+            node_keys[i] = node;
+
+    for (size_t i = 0; i < n; i++)
+      {
+        string syscpu = "/sys/devices/system/cpu/cpu"+ToString(allowed[i]);
+        long socket = ReadIntFile (syscpu+"/topology/physical_package_id", 0);
+        long core = ReadIntFile (syscpu+"/topology/core_id", allowed[i]);
+        long l3 = ReadIntFile (syscpu+"/cache/index3/id", -1);
+        if (l3 == -1)
+          {
+            Array<int> shared = ParseCpuList (ReadLineFile (syscpu+"/cache/index3/shared_cpu_list"));
+            l3 = shared.Size() ? shared[0] : 0;
+          }
+        // ids are unique only within the socket
+        socket_keys[i] = socket;
+        core_keys[i] = (socket << 32) + core;
+        l3_keys[i] = (socket << 32) + l3;
+      }
+#endif
+
+    Array<int> nodes, sockets, cores, l3s;
+    num_nodes = max (Renumber (node_keys, nodes), 1);
+    num_sockets = max (Renumber (socket_keys, sockets), 1);
+    num_cores = max (Renumber (core_keys, cores), 1);
+    num_l3 = max (Renumber (l3_keys, l3s), 1);
+
+    cpus.SetSize (n);
+    for (size_t i = 0; i < n; i++)
+      cpus[i] = CpuInfo { allowed[i], cores[i], sockets[i], nodes[i], l3s[i] };
+
+    QuickSort (FlatArray<CpuInfo> (cpus),
+               [] (const CpuInfo & a, const CpuInfo & b)
+               {
+                 return make_tuple (a.node, a.socket, a.l3, a.core, a.cpu) <
+                   make_tuple (b.node, b.socket, b.l3, b.core, b.cpu);
+               });
+  }
+
+  const Topology & Topology :: Get ()
+  {
+    static Topology topology;
+    return topology;
+  }
+
+  Array<int> Topology :: CpusOfNode (int node) const
+  {
+    Array<int> oscpus;
+    for (auto & c : cpus)
+      if (c.node == node)
+        oscpus.Append (c.cpu);
+    return oscpus;
+  }
+
+  bool Topology :: BindThread (FlatArray<int> oscpus)
+  {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO (&set);
+    for (int c : oscpus)
+      if (c >= 0 && c < CPU_SETSIZE)
+        CPU_SET (c, &set);
+    return pthread_setaffinity_np (pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+  }
+
+  Array<int> Topology :: GetThreadBinding ()
+  {
+    Array<int> oscpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO (&set);
+    if (pthread_getaffinity_np (pthread_self(), sizeof(set), &set) == 0)
+      for (int c = 0; c < CPU_SETSIZE; c++)
+        if (CPU_ISSET (c, &set))
+          oscpus.Append (c);
+#endif
+    if (oscpus.Size() == 0)
+      for (int c = 0; c < int(std::thread::hardware_concurrency()); c++)
+        oscpus.Append (c);
+    return oscpus;
+  }
+
+
+  double Topology :: CpuQuota ()
+  {
+#ifdef __linux__
+    // cgroup of the process, "0::/path" for v2, "n:cpu,cpuacct:/path" for v1
+    string path2, path1;
+    ifstream cgroups("/proc/self/cgroup");
+    string line;
+    while (getline (cgroups, line))
+      {
+        auto pos1 = line.find(':');
+        auto pos2 = line.find(':', pos1+1);
+        if (pos1 == string::npos || pos2 == string::npos) continue;
+        string controllers = line.substr (pos1+1, pos2-pos1-1);
+        string path = line.substr (pos2+1);
+        if (controllers.empty())
+          path2 = path;
+        else if (("," + controllers + ",").find(",cpu,") != string::npos)
+          path1 = path;
+      }
+
+    // v2: "max 100000" or "quota period", the cgroup is mounted as the
+    // root of the container or found by the full path
+    for (string dir : { string("/sys/fs/cgroup")+path2, string("/sys/fs/cgroup") })
+      {
+        stringstream str(ReadLineFile (dir+"/cpu.max"));
+        string quota;
+        double period = 0;
+        if (str >> quota >> period)
+          return (quota == "max" || period <= 0) ? 0 : atof(quota.c_str()) / period;
+      }
+
+    for (string dir : { string("/sys/fs/cgroup/cpu")+path1, string("/sys/fs/cgroup/cpu"),
+          string("/sys/fs/cgroup/cpu,cpuacct") })
+      {
+        long quota = ReadIntFile (dir+"/cpu.cfs_quota_us", 0);
+        long period = ReadIntFile (dir+"/cpu.cfs_period_us", 0);
+        if (period > 0)
+          return quota > 0 ? double(quota) / period : 0;
+      }
+#endif
+    return 0;
+  }
+
+  double Topology :: LoadAverage ()
+  {
+    ifstream in("/proc/loadavg");
+    double load;
+    if (in >> load) return load;
+    return 0;
+  }
+
+
+  ostream & operator<< (ostream & ost, const Topology & topo)
+  {
+    ost << topo.NumCpus() << " cpus, " << topo.NumCores() << " cores, "
+        << topo.NumL3() << " L3 domains, " << topo.NumNodes() << " NUMA nodes, "
+        << topo.NumSockets() << " sockets" << endl;
+    for (auto & c : topo.Cpus())
+      ost << "cpu " << c.cpu << ": core " << c.core << ", l3 " << c.l3
+          << ", node " << c.node << ", socket " << c.socket << endl;
+    return ost;
+  }
+
+}
@@ -0,0 +1,79 @@
+#ifndef FILE_TOPOLOGY
+#define FILE_TOPOLOGY
+
+/**************************************************************************/
+/* File:   topology.hpp                                                   */
+/* Author: Joachim Schoeberl                                              */
+/* Date:   17. Oct. 2026                                                  */
+/**************************************************************************/
+
+
+namespace ngstd
+{
+
+  /**
+     Hardware topology of the cpus the process may run on.
+
+     On Linux sockets, NUMA nodes, cores and L3 domains are read from
+     /sys, restricted to the affinity mask of the process. Otherwise
+     there is one node with hardware_concurrency cpus.
+     Nodes, sockets, cores and L3 domains are numbered consecutively
+     from 0, the cpus are sorted by node, socket, L3 domain and core.
+  */
+  class Topology
+  {
+  public:
+    class CpuInfo
+    {
+    public:
+      int cpu;      // number of the cpu in the operating system
+      int core;     // physical core, SMT siblings share it
+      int socket;
+      int node;     // NUMA node
+      int l3;       // last level cache domain
+    };
+
+  private:
+    Array<CpuInfo> cpus;
+    int num_nodes = 1;
+    int num_sockets = 1;
+    int num_cores = 1;
+    int num_l3 = 1;
+
+  public:
+    NGS_DLL_HEADER Topology ();
+
+    /// topology of the machine, discovered at first call
+    NGS_DLL_HEADER static const Topology & Get ();
+
+    size_t NumCpus () const { return cpus.Size(); }
+    int NumNodes () const { return num_nodes; }
+    int NumSockets () const { return num_sockets; }
+    int NumCores () const { return num_cores; }
+    int NumL3 () const { return num_l3; }
+
+    const CpuInfo & Cpu (size_t i) const { return cpus[i]; }
+    FlatArray<CpuInfo> Cpus () const { return cpus; }
+
+    /// os numbers of the cpus on the given node
+    NGS_DLL_HEADER Array<int> CpusOfNode (int node) const;
+
+    /// restrict the calling thread to the given os cpus
+    NGS_DLL_HEADER static bool BindThread (FlatArray<int> oscpus);
+    /// the os cpus the calling thread may run on
+    NGS_DLL_HEADER static Array<int> GetThreadBinding ();
+
+    /// cpu lists as in sysfs, e.g. "0-3,8,10-11"
+    NGS_DLL_HEADER static Array<int> ParseCpuList (const string & list);
+
+    /// cpus granted by the cgroup (v2 cpu.max or v1 cfs quota), 0 if unlimited
+    NGS_DLL_HEADER static double CpuQuota ();
+    /// one minute load average of the machine, 0 if unknown
+    NGS_DLL_HEADER static double LoadAverage ();
+  };
+
+  NGS_DLL_HEADER ostream & operator<< (ostream & ost, const Topology & topo);
+
+}
+
+#endif
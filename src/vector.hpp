@@ -1780,9 +1780,38 @@ namespace ngbla
     for (int i = 0; i < DIM; i++)
       MyAtomicAdd (x(i), y(i));
   }
-  
 
-  
+
+
+  /*
+    Multithreaded inner product and norm of large vectors.
+    The results are bit-identical for any number of threads,
+    see ReproducibleSum.
+  */
+  template <typename TA, typename TB>
+  INLINE auto ParallelInnerProduct (FlatVector<TA> a, FlatVector<TB> b,
+                                    bool compensated = false)
+    -> decltype (InnerProduct(a(0), b(0)))
+  {
+    return ReproducibleSum (a.Size(), [a,b] (size_t i) { return InnerProduct (a(i), b(i)); },
+                            compensated);
+  }
+
+  template <typename T>
+  INLINE auto ParallelL2Norm2 (FlatVector<T> v, bool compensated = false)
+    -> decltype (L2Norm2(v(0)))
+  {
+    return ReproducibleSum (v.Size(), [v] (size_t i) { return L2Norm2 (v(i)); },
+                            compensated);
+  }
+
+  template <typename T>
+  INLINE auto ParallelL2Norm (FlatVector<T> v, bool compensated = false)
+    -> decltype (L2Norm2(v(0)))
+  {
+    return sqrt (ParallelL2Norm2 (v, compensated));
+  }
+
 }
 
 